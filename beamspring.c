@@ -15,6 +15,7 @@
  */
 
 #include "beamspring.h"
+#include "matrix_manipulate.h"
 
 // Pandrew util assumes this to be ``wcass.c''.
 // But since we dropped the raw hid support we don't care about it.
@@ -25,6 +26,51 @@ void keyboard_post_init_kb(void) {
     //    debug_matrix=true;
 }
 
+#if CAPSENSE_SOLENOID
+#    ifdef HAPTIC_EXCLUSION_KEYS
+// Same hook as QMK's haptic feedback: keymaps can override this to exclude keys from the solenoid.
+__attribute__((weak)) bool get_haptic_enabled_key(uint16_t keycode, keyrecord_t *record) {
+    return true;
+}
+#    endif
+
+// Returns whether a press of keycode fires the solenoid. With NO_HAPTIC_MOD, modifiers and layer
+// keys don't, unless they're tapped, like with QMK's haptic feedback.
+static bool solenoid_key_enabled(uint16_t keycode, keyrecord_t *record) {
+#    ifdef NO_HAPTIC_MOD
+    switch (keycode) {
+#        ifndef NO_ACTION_TAPPING
+        case QK_MOD_TAP ... QK_MOD_TAP_MAX:
+        case QK_LAYER_TAP ... QK_LAYER_TAP_MAX:
+            if (record->tap.count == 0) return false;
+            break;
+        case QK_LAYER_TAP_TOGGLE ... QK_LAYER_TAP_TOGGLE_MAX:
+            if (record->tap.count != TAPPING_TOGGLE) return false;
+            break;
+#        endif
+        case KC_LEFT_CTRL ... KC_RIGHT_GUI:
+        case QK_MOMENTARY ... QK_MOMENTARY_MAX:
+        case QK_LAYER_MOD ... QK_LAYER_MOD_MAX:
+            return false;
+    }
+#    endif
+#    ifdef HAPTIC_EXCLUSION_KEYS
+    return get_haptic_enabled_key(keycode, record);
+#    else
+    return true;
+#    endif
+}
+
+// The solenoid is requested here, on debounced presses, rather than by the scan, so that it never
+// fires on a raw sample that debounce would have rejected. The scan only times the pin changes.
+bool process_record_kb(uint16_t keycode, keyrecord_t *record) {
+    if (record->event.pressed && solenoid_key_enabled(keycode, record)) {
+        capsense_solenoid_fire();
+    }
+    return process_record_user(keycode, record);
+}
+#endif
+
 // Optional override functions below.
 // You can leave any or all of these undefined.
 // These are only required if you want to perform custom actions.
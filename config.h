@@ -78,7 +78,11 @@
 //   #define RGBLIGHT_EFFECT_BREATHE_MAX    255   // 0 to 255
 // #endif
 
-/* Debounce reduces chatter (unintended double-presses) - set 0 if debouncing is not needed */
+/* Debounce reduces chatter (unintended double-presses) - set 0 if debouncing is not needed.
+ * With CAPSENSE_CAL_HYSTERESIS, CAPSENSE_CAL_HYSTERESIS_DEBOUNCE is used instead, and with
+ * CAPSENSE_KEY_DEBOUNCE or CAPSENSE_EVENT_QUEUE, 0. Keys on MATRIX_EXTRA_DIRECT_ROWS are debounced
+ * in the matrix scan in any case, releases for MATRIX_EXTRA_DIRECT_DEBOUNCE_MS (by default
+ * CAPSENSE_KEY_DEBOUNCE_RELEASE_MS with CAPSENSE_KEY_DEBOUNCE, and 5 otherwise) */
 #define DEBOUNCE 5
 
 /* define if matrix has ghost (lacks anti-ghosting diodes) */
@@ -270,6 +274,167 @@
 
 #define CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col) (((col) >= 2) ? ((col) + 2) : (col))
 
+// Use the hardware SPI (or USART in SPI mode) to write the DAC and the shift register, where the
+// controller has them wired to the right pins. Other pins keep using the bit-banged implementation:
+// #define CAPSENSE_HW_SPI_ENABLE 1
+
+// Load the shift register once per scan pass and step the selected column with one SHCP clock per
+// column, instead of re-shifting the full pattern and deselecting after every column. The settle
+// time is then only waited once at the end of each pass:
+// #define CAPSENSE_SHIFT_WALKING_ONE 1
+
+// Overlap the column and DAC settle times with decoding the previous sample, shifting in the next
+// column, and writing the next DAC threshold. Uses Timer1 to time the remaining settle time:
+// #define CAPSENSE_SCAN_PIPELINED 1
+
+// Scan in the background from a Timer1 interrupt, and only pick up complete matrices in the main
+// loop. Each interrupt samples all the columns of one bin, and the DAC settle time in between bins is
+// timed with Timer1, so a pass takes about as long as in the main loop. The main loop gets those
+// gaps, and CAPSENSE_SCAN_ISR_GAP_US after every pass:
+// #define CAPSENSE_SCAN_IN_ISR 1
+// #define CAPSENSE_SCAN_ISR_GAP_US 100
+
+// Start one scan per USB frame, timed so that the scan and the resulting report are ready
+// CAPSENSE_SCAN_SOF_MARGIN_US before the host's next poll, instead of scanning back to back.
+// The time from start-of-frame to report ready is measured, and printed with CAPSENSE_SCAN_STATS:
+// #define CAPSENSE_SCAN_SOF_SYNC 1
+// #define CAPSENSE_SCAN_SOF_MARGIN_US 100
+
+// Sample the rows a selectable number of CPU cycles after the column is strobed, instead of after a
+// number of test_single() loop iterations (12-18 cycles each). The sample point is in
+// capsense_sample_cycles, which starts at CAPSENSE_HARDCODED_SAMPLE_CYCLES (by default the same
+// point as CAPSENSE_HARDCODED_SAMPLE_TIME), and is used by both the scan and the calibration:
+// #define CAPSENSE_SAMPLE_CYCLE_ACCURATE 1
+// #define CAPSENSE_HARDCODED_SAMPLE_CYCLES 48
+
+// Time-domain calibration: use only CAPSENSE_CAL_TIME_DOMAIN_LEVELS DAC thresholds, and instead give
+// every key its own sample time within the first CAPSENSE_CAL_TIME_DOMAIN_SAMPLES test_single() loop
+// iterations. Each column is then strobed once per level, and all its sample times are captured at
+// once, instead of writing and settling the DAC for up to CAPSENSE_CAL_BINS thresholds:
+// #define CAPSENSE_CAL_TIME_DOMAIN 1
+// #define CAPSENSE_CAL_TIME_DOMAIN_LEVELS 2
+// #define CAPSENSE_CAL_TIME_DOMAIN_SAMPLES 8
+
+// Hot-key priority scanning: the keys whose layer 0 keycode is a modifier or is listed in
+// CAPSENSE_SCAN_HOT_KEYCODES (by default WASD, the keys of the default keymap's SOCD pairs) are
+// scanned on every pass, and the rest of the keys only in one of CAPSENSE_SCAN_COLD_SLICES slices
+// per pass, round-robin. With CAPSENSE_SCAN_STATS, the rate of the cold keys is printed too:
+// #define CAPSENSE_SCAN_HOT_KEYS 1
+// #define CAPSENSE_SCAN_HOT_KEYCODES KC_W, KC_A, KC_S, KC_D
+// #define CAPSENSE_SCAN_COLD_SLICES 4
+
+// Eager scanning: stop the scan pass right after any column sample that changed the matrix, so that
+// QMK sees the change without waiting for the rest of the pass, and continue the pass on the next
+// scan. The whole matrix is still checked against the scanner at the end of every pass. With
+// CAPSENSE_SCAN_IN_ISR, changed columns are handed over as they are sampled instead:
+// #define CAPSENSE_SCAN_EAGER 1
+
+// Idle scanning: after CAPSENSE_SCAN_IDLE_TIMEOUT_MS without any key changing state (and no key held
+// down), scan only once every CAPSENSE_SCAN_IDLE_PERIOD_MS, and keep the MCU in idle sleep between
+// timer ticks. The first detected change returns to full rate; the worst-case extra latency of the
+// first press is CAPSENSE_SCAN_IDLE_PERIOD_MS plus one scan pass (with CAPSENSE_SCAN_HOT_KEYS, idle
+// passes scan all the keys, not just one cold slice). Not available with
+// CAPSENSE_SCAN_IN_ISR. Compare the supply current with and without it, e.g. after the timeout:
+// #define CAPSENSE_SCAN_IDLE 1
+// #define CAPSENSE_SCAN_IDLE_TIMEOUT_MS 30000
+// #define CAPSENSE_SCAN_IDLE_PERIOD_MS 10
+
+// USB suspend scanning: while suspended, the remote wakeup check samples each column once with the
+// DAC at a single conservative threshold (CAPSENSE_CAL_THRESHOLD_OFFSET beyond the level where all
+// keys at rest read as released, or CAPSENSE_HARDCODED_THRESHOLD without calibration), with the shift
+// register outputs disabled in between. On wake up, the calibrated scan resumes without recalibration:
+// #define CAPSENSE_SUSPEND_SCAN 1
+
+// Column scan order within each calibration bin: CAPSENSE_COL_ORDER_KEYMAP (the default),
+// CAPSENSE_COL_ORDER_INTERLEAVED (every other physical column, then the ones in between), or
+// CAPSENSE_COL_ORDER_FARTHEST_FIRST (alternating between the two halves of the board). Orders other
+// than the keymap order make CAPSENSE_SHIFT_WALKING_ONE reload the shift register more often.
+// The settle time diagnostic measures, at startup, the shortest CAPSENSE_KEYBOARD_SETTLE_TIME_US that
+// each order would need (up to CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US), and prints it after 10 seconds. It
+// slows down every boot, so it requires CAPSENSE_CAL_DEBUG, and it uses Timer1:
+// #define CAPSENSE_SCAN_COL_ORDER CAPSENSE_COL_ORDER_INTERLEAVED
+// #define CAPSENSE_SETTLE_DIAGNOSTIC 1
+// #define CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US 50
+// #define CAPSENSE_SETTLE_DIAGNOSTIC_REPS 8
+
+// Event queue (requires CAPSENSE_SCAN_IN_ISR): the scan ISR queues every key transition with a
+// timestamp, and each matrix scan hands exactly one of them to QMK, in order, so that transitions
+// seen while the main loop is busy (e.g. in a macro) are neither merged nor reordered. The time of
+// the last published event is in capsense_event_time. CAPSENSE_EVENT_QUEUE_SIZE must be a power of
+// two; overflows are counted, and resynchronize the whole matrix. DEBOUNCE is set to 0, because
+// QMK's debounce would merge the events of a burst into one matrix update again:
+// #define CAPSENSE_EVENT_QUEUE 1
+// #define CAPSENSE_EVENT_QUEUE_SIZE 16
+
+// Hysteresis (requires calibration): each bin gets a press threshold and a release threshold,
+// CAPSENSE_CAL_HYSTERESIS_BAND apart and centred on the calibrated threshold, and each key is compared
+// against the one for its current state (pressed keys are sampled a second time, at the release
+// threshold). Noise near the threshold then can't make a key chatter, so DEBOUNCE is replaced by
+// CAPSENSE_CAL_HYSTERESIS_DEBOUNCE. Not available with CAPSENSE_SCAN_IN_ISR:
+// #define CAPSENSE_CAL_HYSTERESIS 1
+// #define CAPSENSE_CAL_HYSTERESIS_BAND 30
+// #define CAPSENSE_CAL_HYSTERESIS_DEBOUNCE 0
+
+// Per-key debounce in the matrix scan, instead of QMK's DEBOUNCE (which is then set to 0): presses
+// are committed on the first clean sample, releases once the key has read as released for
+// CAPSENSE_KEY_DEBOUNCE_RELEASE_MS. Samples with the interference bit set (the row was already high
+// before the strobe) never change a key, and restart a pending release. Costs a byte of RAM per key:
+// #define CAPSENSE_KEY_DEBOUNCE 1
+// #define CAPSENSE_KEY_DEBOUNCE_RELEASE_MS 5
+
+// Re-sampling of interfered slots (requires calibration, not available with CAPSENSE_SCAN_IN_ISR):
+// slots whose sample had an interference bit set are sampled again right after the range they're in,
+// up to CAPSENSE_SCAN_RESAMPLE_BUDGET re-samples per pass, instead of leaving those keys alone until
+// the next pass. The re-samples, and the interfered samples over budget, are counted in
+// capsense_scan_resamples and capsense_scan_resample_drops. CAPSENSE_INTERFERENCE_SAMPLES is the
+// number of row reads before the strobe that the interference bits are taken from (3 by default with
+// re-sampling, 1 otherwise; with CAPSENSE_CAL_TIME_DOMAIN, always 1):
+// #define CAPSENSE_SCAN_RESAMPLE 1
+// #define CAPSENSE_SCAN_RESAMPLE_BUDGET 8
+// #define CAPSENSE_INTERFERENCE_SAMPLES 3
+
+// Voting for marginal keys (requires calibration, not available with CAPSENSE_CAL_TIME_DOMAIN or
+// CAPSENSE_SCAN_IN_ISR): calibration marks the keys whose own level is within
+// CAPSENSE_SCAN_VOTING_MARGIN of their bin's threshold, and a transition of one of those keys is only
+// applied once it wins a majority of up to CAPSENSE_SCAN_VOTING_SAMPLES samples of its column, which
+// stop as soon as the outcome is certain. Other keys still take one sample per pass. Needs an extra
+// byte of stack per key during calibration:
+// #define CAPSENSE_SCAN_VOTING 1
+// #define CAPSENSE_SCAN_VOTING_MARGIN 15
+// #define CAPSENSE_SCAN_VOTING_SAMPLES 5
+
+// Rapid trigger (requires calibration, not available with CAPSENSE_SCAN_IN_ISR): the keys whose
+// layer 0 keycode is in CAPSENSE_RAPID_TRIGGER_KEYCODES (up to CAPSENSE_RAPID_TRIGGER_MAX_KEYS) leave
+// the normal scan. Instead, their signal level is tracked with CAPSENSE_RAPID_TRIGGER_STEPS DAC steps
+// each per pass, and they're pressed as soon as the level rises CAPSENSE_RAPID_TRIGGER_DELTA above its
+// lowest point (and above the level at rest), and released as soon as it drops by as much from its
+// highest point, so a key can be pressed again without going all the way back up. While a key is
+// released, its lowest point (and, without CAPSENSE_DRIFT_COMPENSATION, its level at rest) follows
+// the level by one DAC unit every CAPSENSE_RAPID_TRIGGER_FOLLOW_MS, so that slow drift doesn't press it:
+// #define CAPSENSE_RAPID_TRIGGER 1
+// #define CAPSENSE_RAPID_TRIGGER_KEYCODES KC_W, KC_A, KC_S, KC_D
+// #define CAPSENSE_RAPID_TRIGGER_MAX_KEYS 8
+// #define CAPSENSE_RAPID_TRIGGER_DELTA 15
+// #define CAPSENSE_RAPID_TRIGGER_STEPS 3
+// #define CAPSENSE_RAPID_TRIGGER_FOLLOW_MS 250
+
+// Drift compensation (requires calibration, not available with CAPSENSE_SCAN_IN_ISR): the levels of
+// the reference keys in CAPSENSE_DRIFT_REF_KEYS (physical {col, row} pairs, required, for pads that are
+// never pressed; positions that aren't KC_NO in layer 0 are skipped, and without any left, there's no
+// compensation) are followed with CAPSENSE_DRIFT_STEPS DAC steps per pass. Every CAPSENSE_DRIFT_FILTER_PERIOD_MS, they're low-pass
+// filtered with a time constant of (1 << CAPSENSE_DRIFT_FILTER_SHIFT) * CAPSENSE_DRIFT_FILTER_PERIOD_MS
+// (about 10 s by default), and all thresholds are shifted by their average change since calibration.
+// The shift is in capsense_cal_drift:
+// #define CAPSENSE_DRIFT_COMPENSATION 1
+// #define CAPSENSE_DRIFT_REF_KEYS {0, 7}, {4, 1}
+// #define CAPSENSE_DRIFT_STEPS 1
+// #define CAPSENSE_DRIFT_FILTER_SHIFT 8
+// #define CAPSENSE_DRIFT_FILTER_PERIOD_MS 40
+
+// Count complete scan passes per second (printed to the console when printing is enabled), to
+// compare the different scan modes:
+// #define CAPSENSE_SCAN_STATS 1
+
 // By default we set up for support of xwhatsit's solenoid driver board.
 // Comment out HAPTIC_ENABLE_PIN if you don't have an enable pin:
 // #define HAPTIC_ENABLE_PIN B7
@@ -284,6 +449,18 @@
 // #define SOLENOID_MAX_DWELL 100
 // #define NO_HAPTIC_MOD
 // #define HAPTIC_EXCLUSION_KEYS 1
+// Alternatively, without HAPTIC_ENABLE, the solenoid can be driven in sync with the scan: every
+// debounced key press fires a pulse, but the solenoid pin only changes between scan passes, followed
+// by CAPSENSE_SOLENOID_SETTLE_US before the next sample, so that the current step never lands in the
+// middle of a sample. HAPTIC_ENABLE_PIN, HAPTIC_OFF_IN_LOW_POWER and NO_HAPTIC_MOD above still apply,
+// and with HAPTIC_EXCLUSION_KEYS, keys can be excluded by overriding get_haptic_enabled_key(). Pulses can be
+// turned off with capsense_solenoid_enabled, or fired from the keymap with capsense_solenoid_fire().
+// Interfered samples are counted separately for while the solenoid is energized and while it's off
+// (printed with CAPSENSE_SCAN_STATS):
+// #define CAPSENSE_SOLENOID 1
+// #define CAPSENSE_SOLENOID_PIN B6
+// #define CAPSENSE_SOLENOID_DWELL_MS 20
+// #define CAPSENSE_SOLENOID_SETTLE_US 100
 
 // If the lock lights are not used, then please don't define the below pins,
 // or leave them set as unused pins:
@@ -17,6 +17,13 @@
 #include "quantum.h"
 #include "matrix_manipulate.h"
 #include <string.h>
+#if CAPSENSE_SCAN_IDLE
+#    include <avr/sleep.h>
+#endif
+#if CAPSENSE_SCAN_IN_ISR
+#    include <avr/interrupt.h>
+#    include <util/atomic.h>
+#endif
 
 /* Notes on Expansion Header:
 
@@ -45,12 +52,170 @@ pin 4 = HEADER4 = RXI        = PD2
 pin 5 = HEADER2 = D(igital)7 = PE6
 */
 
+#if CAPSENSE_SCAN_PIPELINED || CAPSENSE_SCAN_IN_ISR || CAPSENSE_SCAN_SOF_SYNC || CAPSENSE_SETTLE_DIAGNOSTIC
+#    define SCAN_TIMER_ENABLED
+#endif
+
+#ifdef SCAN_TIMER_ENABLED
+// Timer1 runs freely at F_CPU / 8, and is used as a stopwatch for the settle times, so that the
+// scan can do useful work while waiting, and only wait for the time that's left.
+#    define SCAN_TIMER_US_TO_TICKS(us) ((uint16_t)((us) * (F_CPU / 8000000UL)))
+#    define SCAN_TIMER_TICKS_TO_US(ticks) ((uint16_t)((ticks) / (F_CPU / 8000000UL)))
+
+static inline void scan_timer_init(void) {
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11);
+}
+
+static inline uint16_t scan_timer_read(void) {
+    return TCNT1;
+}
+
+static inline void scan_timer_wait_until(uint16_t deadline) {
+    while ((int16_t)(TCNT1 - deadline) < 0)
+        ;
+}
+#endif
+
+#ifdef CAPSENSE_READ_ROWS_DECODE_NIBBLE_TABLES
+// The samples are decoded with a 16 entry table for the high nibble of the first byte, and one for the
+// low nibble of the second byte. The tables are generated by the compiler from
+// CAPSENSE_READ_ROWS_DECODE, so they always match the controller definition.
+#    define DECODE_TABLE_ENTRIES(f) f(0), f(1), f(2), f(3), f(4), f(5), f(6), f(7), f(8), f(9), f(10), f(11), f(12), f(13), f(14), f(15)
+#    define DECODE_TABLE_1_ENTRY(n) CAPSENSE_READ_ROWS_DECODE((n) << 4, 0)
+#    define DECODE_TABLE_2_ENTRY(n) CAPSENSE_READ_ROWS_DECODE(0, (n))
+static const uint8_t PROGMEM decode_table_1[16] = {DECODE_TABLE_ENTRIES(DECODE_TABLE_1_ENTRY)};
+static const uint8_t PROGMEM decode_table_2[16] = {DECODE_TABLE_ENTRIES(DECODE_TABLE_2_ENTRY)};
+_Static_assert(CAPSENSE_READ_ROWS_DECODE(0x0f, 0xf0) == 0, "The decode tables only cover the high nibble of the first byte and the low nibble of the second byte");
+#    undef CAPSENSE_READ_ROWS_VALUE
+#    define CAPSENSE_READ_ROWS_VALUE (pgm_read_byte(&decode_table_1[dest_row_1 >> 4]) | pgm_read_byte(&decode_table_2[dest_row_2 & 0xf]))
+
+#    if CAPSENSE_CAL_DEBUG
+static bool decode_tables_ok = true;
+
+// Compares the table based decode with CAPSENSE_READ_ROWS_DECODE, for every possible pair of bytes.
+static void decode_tables_self_check(void) {
+    uint8_t dest_row_1 = 0, dest_row_2 = 0;
+    do {
+        do {
+            if ((uint8_t)(CAPSENSE_READ_ROWS_VALUE) != (uint8_t)(CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2))) {
+                decode_tables_ok = false;
+            }
+        } while (++dest_row_2);
+    } while (++dest_row_1);
+}
+#    endif
+#endif
+
 static inline uint8_t read_rows(void) {
     CAPSENSE_READ_ROWS_LOCAL_VARS;
     asm volatile(CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS:CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS : CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS);
     return CAPSENSE_READ_ROWS_VALUE;
 }
 
+#if defined(CAPSENSE_DAC_USE_SPI) || defined(CAPSENSE_SHIFT_USE_SPI)
+// Hardware SPI master at F_CPU / 2. SPCR is rewritten at the start of every transfer, so that the DAC
+// and the shift register can share the pins while using different clock phases.
+static inline void hw_spi_init(void) {
+    setPinOutput(B1); // SCK
+    setPinOutput(B2); // MOSI
+    if (!(DDRB & (1 << 0))) {
+        PORTB |= (1 << 0); // SS must not go low, or the SPI falls back to slave mode
+    }
+    SPSR = (1 << SPI2X);
+}
+
+static inline void hw_spi_begin(uint8_t cpha) {
+    SPCR = (1 << SPE) | (1 << MSTR) | (cpha << CPHA);
+}
+
+static inline void hw_spi_write(uint8_t data) {
+    SPDR = data;
+    while (!(SPSR & (1 << SPIF)))
+        ;
+}
+
+// Hands SCK and MOSI back to the PORT register, so that they can be bit-banged.
+static inline void hw_spi_end(void) {
+    SPCR = 0;
+}
+#endif
+
+#if defined(CAPSENSE_DAC_USE_USART_SPI) || defined(CAPSENSE_SHIFT_USE_USART_SPI)
+// USART1 in master SPI mode at F_CPU / 2. XCK1 (D5) is the clock, TXD1 (D3) is the data output.
+// Unlike the SPI, the transmitter is double buffered, so consecutive bytes are sent back to back.
+static inline void usart_spi_init(void) {
+    UBRR1 = 0;
+    setPinOutput(D5); // XCK1
+    setPinOutput(D3); // TXD1
+}
+
+static inline void usart_spi_begin(uint8_t cpha) {
+    UCSR1C = (1 << UMSEL11) | (1 << UMSEL10) | (cpha << UCPHA1);
+    UCSR1B = (1 << TXEN1);
+    UBRR1  = 0; // The baud rate must be set after the transmitter is enabled
+}
+
+static inline void usart_spi_write(uint8_t data) {
+    while (!(UCSR1A & (1 << UDRE1)))
+        ;
+    UCSR1A = (1 << TXC1); // Clear the transmit complete flag
+    UDR1   = data;
+}
+
+static inline void usart_spi_flush(void) {
+    while (!(UCSR1A & (1 << TXC1)))
+        ;
+}
+
+// Hands XCK1 and TXD1 back to the PORT register, so that they can be bit-banged.
+static inline void usart_spi_end(void) {
+    usart_spi_flush();
+    UCSR1B = 0;
+    UCSR1C = 0;
+}
+#endif
+
+#if defined(CAPSENSE_DAC_MCP4921)
+#    define DAC_SCLK CAPSENSE_DAC_SCK
+#    define DAC_DIN CAPSENSE_DAC_SDI
+#    define DAC_SPI_CPHA 0 // The MCP4921 latches data on the rising edge of SCK
+#else
+#    define DAC_SCLK CAPSENSE_DAC_SCLK
+#    define DAC_DIN CAPSENSE_DAC_DIN
+#    define DAC_SPI_CPHA 1 // This DAC latches data on the falling edge of SCLK
+#endif
+
+static inline void dac_bus_init(void) {
+#if defined(CAPSENSE_DAC_USE_SPI)
+    hw_spi_init();
+#elif defined(CAPSENSE_DAC_USE_USART_SPI)
+    usart_spi_init();
+#endif
+}
+
+// Shifts out 16 bits MSB first. The chip select has to be handled by the caller.
+static inline void dac_shift_out(uint16_t value) {
+#if defined(CAPSENSE_DAC_USE_SPI)
+    hw_spi_begin(DAC_SPI_CPHA);
+    hw_spi_write(value >> 8);
+    hw_spi_write(value & 0xff);
+#elif defined(CAPSENSE_DAC_USE_USART_SPI)
+    usart_spi_begin(DAC_SPI_CPHA);
+    usart_spi_write(value >> 8);
+    usart_spi_write(value & 0xff);
+    usart_spi_flush();
+#else
+    int i;
+    for (i = 0; i < 16; i++) {
+        writePin(DAC_DIN, (value >> 15) & 1);
+        value <<= 1;
+        writePin(DAC_SCLK, 1);
+        writePin(DAC_SCLK, 0);
+    }
+#endif
+}
+
 #if defined(CAPSENSE_DAC_MCP4921)
 
 void dac_init(void) {
@@ -61,9 +226,11 @@ void dac_init(void) {
     writePin(CAPSENSE_DAC_NCS, 1);
     writePin(CAPSENSE_DAC_SCK, 0);
     writePin(CAPSENSE_DAC_SDI, 0);
+    dac_bus_init();
 }
 
-void dac_write_threshold(uint16_t value) {
+// Writes the DAC without waiting for its output to settle.
+static void dac_write_threshold_no_settle(uint16_t value) {
     const uint16_t buffered = 0;
 #    define nSHDN_BIT 12
     value |= 1 << nSHDN_BIT; // nSHDN = 0 -- make sure output is not floating.
@@ -75,15 +242,8 @@ void dac_write_threshold(uint16_t value) {
     value |= buffered << BUF_BIT;
 
     writePin(CAPSENSE_DAC_NCS, 0);
-    int i;
-    for (i = 0; i < 16; i++) {
-        writePin(CAPSENSE_DAC_SDI, (value >> 15) & 1);
-        value <<= 1;
-        writePin(CAPSENSE_DAC_SCK, 1);
-        writePin(CAPSENSE_DAC_SCK, 0);
-    }
+    dac_shift_out(value);
     writePin(CAPSENSE_DAC_NCS, 1);
-    wait_us(CAPSENSE_DAC_SETTLE_TIME_US);
 }
 
 #else
@@ -96,41 +256,81 @@ void dac_init(void) {
     writePin(CAPSENSE_DAC_SCLK, 0);
     writePin(CAPSENSE_DAC_SCLK, 1);
     writePin(CAPSENSE_DAC_SCLK, 0);
+    dac_bus_init();
 }
 
-void dac_write_threshold(uint16_t value) {
+// Writes the DAC without waiting for its output to settle.
+static void dac_write_threshold_no_settle(uint16_t value) {
     value <<= 2; // The two LSB bits of this DAC are don't care.
     writePin(CAPSENSE_DAC_SYNC_N, 0);
-    int i;
-    for (i = 0; i < 16; i++) {
-        writePin(CAPSENSE_DAC_DIN, (value >> 15) & 1);
-        value <<= 1;
-        writePin(CAPSENSE_DAC_SCLK, 1);
-        writePin(CAPSENSE_DAC_SCLK, 0);
-    }
+    dac_shift_out(value);
     writePin(CAPSENSE_DAC_SYNC_N, 1);
+#    if defined(CAPSENSE_DAC_USE_SPI)
+    hw_spi_end();
+#    elif defined(CAPSENSE_DAC_USE_USART_SPI)
+    usart_spi_end();
+#    endif
     writePin(CAPSENSE_DAC_SCLK, 1);
     writePin(CAPSENSE_DAC_SCLK, 0);
-    wait_us(CAPSENSE_DAC_SETTLE_TIME_US);
 }
 
 #endif
 
+void dac_write_threshold(uint16_t value) {
+    dac_write_threshold_no_settle(value);
+    wait_us(CAPSENSE_DAC_SETTLE_TIME_US);
+}
+
 #define SHIFT_BITS (((CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(MATRIX_COLS - 1) >= 16) || (CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(0) >= 16)) ? 24 : 16)
 
+// Gives the shift register lines back to the PORT register before they are bit-banged.
+static inline void shift_bus_release(void) {
+#if defined(CAPSENSE_SHIFT_USE_SPI)
+    hw_spi_end();
+#elif defined(CAPSENSE_SHIFT_USE_USART_SPI)
+    usart_spi_end();
+#endif
+}
+
+#if defined(CAPSENSE_SHIFT_USE_SPI) || defined(CAPSENSE_SHIFT_USE_USART_SPI)
+// Shifts out SHIFT_BITS bits, with only bit `col` set (or none, if col >= SHIFT_BITS).
+static inline void shift_bus_select(uint8_t col) {
+    uint8_t byte_index = col >> 3;
+    uint8_t bit        = (uint8_t)1 << (col & 7);
+    int8_t  i;
+#    if defined(CAPSENSE_SHIFT_USE_SPI)
+    hw_spi_begin(0);
+    for (i = SHIFT_BITS / 8 - 1; i >= 0; i--) {
+        hw_spi_write((i == byte_index) ? bit : 0);
+    }
+#    else
+    usart_spi_begin(0);
+    for (i = SHIFT_BITS / 8 - 1; i >= 0; i--) {
+        usart_spi_write((i == byte_index) ? bit : 0);
+    }
+    usart_spi_flush();
+#    endif
+}
+#endif
+
 void shift_select_nothing(void) {
+#if defined(CAPSENSE_SHIFT_USE_SPI) || defined(CAPSENSE_SHIFT_USE_USART_SPI)
+    shift_bus_select(0xff);
+#else
     writePin(CAPSENSE_SHIFT_DIN, 0);
     int i;
     for (i = 0; i < SHIFT_BITS; i++) {
         writePin(CAPSENSE_SHIFT_SHCP, 1);
         writePin(CAPSENSE_SHIFT_SHCP, 0);
     }
+#endif
     writePin(CAPSENSE_SHIFT_STCP, 1);
     writePin(CAPSENSE_SHIFT_STCP, 0);
 }
 
 void shift_data(uint32_t data, int data_idle, int shcp_idle, int stcp_idle) {
     int i;
+    shift_bus_release();
     writePin(CAPSENSE_SHIFT_SHCP, 0);
     writePin(CAPSENSE_SHIFT_STCP, 0);
     for (i = SHIFT_BITS - 1; i >= 0; i--) {
@@ -149,12 +349,24 @@ void shift_data(uint32_t data, int data_idle, int shcp_idle, int stcp_idle) {
 }
 
 void shift_select_col_no_strobe(uint8_t col) {
+#if defined(CAPSENSE_SHIFT_USE_SPI) || defined(CAPSENSE_SHIFT_USE_USART_SPI)
+    shift_bus_select(col);
+#else
+    // Only the selected column's bit is set, so DIN is only written around that bit.
     int i;
+    writePin(CAPSENSE_SHIFT_DIN, 0);
     for (i = SHIFT_BITS - 1; i >= 0; i--) {
-        writePin(CAPSENSE_SHIFT_DIN, !!(col == i));
-        writePin(CAPSENSE_SHIFT_SHCP, 1);
-        writePin(CAPSENSE_SHIFT_SHCP, 0);
+        if (i == col) {
+            writePin(CAPSENSE_SHIFT_DIN, 1);
+            writePin(CAPSENSE_SHIFT_SHCP, 1);
+            writePin(CAPSENSE_SHIFT_SHCP, 0);
+            writePin(CAPSENSE_SHIFT_DIN, 0);
+        } else {
+            writePin(CAPSENSE_SHIFT_SHCP, 1);
+            writePin(CAPSENSE_SHIFT_SHCP, 0);
+        }
     }
+#endif
 }
 
 static inline void shift_select_col(uint8_t col) {
@@ -171,6 +383,11 @@ void shift_init(void) {
     writePin(CAPSENSE_SHIFT_OE, 0);
     writePin(CAPSENSE_SHIFT_STCP, 0);
     writePin(CAPSENSE_SHIFT_SHCP, 0);
+#if defined(CAPSENSE_SHIFT_USE_SPI)
+    hw_spi_init();
+#elif defined(CAPSENSE_SHIFT_USE_USART_SPI)
+    usart_spi_init();
+#endif
     shift_select_nothing();
     wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
 }
@@ -178,16 +395,17 @@ void shift_init(void) {
 // Timing:
 // IN instructions (1 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE)
 // Store to array instructions (2 * number of bytes)
-// adiw: 1 cycle
+// adiw: 2 cycles
 // cp: 1 cycle
 // cpc: 1 cycle
 // brlo: 2 cycles (when jumping)
 // --- Total loop length:
-// 3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 5 cycles
+// 3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 6 cycles
 // First sample elements will be taken after [1..CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE-1] cycles
 // Second sample elements will be taken after
-//       [3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 5 + 1..
-//        3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 5 + CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE-1] cycles
+//       [3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 6 + 1..
+//        3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 6 + CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE-1] cycles
+#define SAMPLE_LOOP_CYCLES (3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 6)
 
 // The following function requires storage for CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE * (time + 1) bytes but returns valid data only in the first (time + 1) bytes
 void test_multiple(uint8_t col, uint16_t time, uint8_t *array) {
@@ -229,16 +447,36 @@ void test_multiple(uint8_t col, uint16_t time, uint8_t *array) {
     wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
 }
 
-uint8_t test_single(uint8_t col, uint16_t time, uint8_t *interference_ptr) {
-    shift_select_col_no_strobe(col);
+#if CAPSENSE_INTERFERENCE_SAMPLES > 1
+// Reads the rows CAPSENSE_INTERFERENCE_SAMPLES - 1 times, ahead of the interference sample that's taken
+// right before the STCP rising edge. A row that's high in any of them counts as interfered.
+static inline uint8_t read_rows_baseline(void) {
+    uint8_t baseline = 0;
+    uint8_t i;
+    for (i = 1; i < CAPSENSE_INTERFERENCE_SAMPLES; i++) {
+        baseline |= read_rows();
+    }
+    return baseline;
+}
+#endif
+
+// Samples the rows around the STCP rising edge, with the column pattern already loaded into the
+// shift register (but not yet strobed). The selected column is left latched on return.
+static inline uint8_t test_single_strobed(uint16_t time, uint8_t *interference_ptr) {
     uint16_t index;
     CAPSENSE_READ_ROWS_LOCAL_VARS;
     uint8_t  array[CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 1]; // one sample before triggering, and one dummy byte
     uint8_t *arrayp = array;
+    uint8_t  sreg;
+#if CAPSENSE_INTERFERENCE_SAMPLES > 1
+    uint8_t baseline = interference_ptr ? read_rows_baseline() : 0;
+#endif
     asm volatile("ldi %A[index], 0"
                  "\n\t"
                  "ldi %B[index], 0"
                  "\n\t"
+                 "in %[sreg], __SREG__"
+                 "\n\t"
                  "cli"
                  "\n\t" CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS "\n\t" CAPSENSE_READ_ROWS_STORE_TO_ARRAY_INSTRUCTIONS "\n\t"
                  "sbi %[stcp_regaddr], %[stcp_bit]"
@@ -252,25 +490,249 @@ uint8_t test_single(uint8_t col, uint16_t time, uint8_t *interference_ptr) {
                  "\n\t"
                  "brlo 1b"
                  "\n\t"
-                 "sei"
+                 "out __SREG__, %[sreg]"
                  "\n\t"
                  "cbi %[stcp_regaddr], %[stcp_bit]"
                  "\n\t"
-                 : [arr] "=e"(arrayp), [index] "=&w"(index), CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS
+                 : [arr] "=e"(arrayp), [index] "=&w"(index), [sreg] "=&r"(sreg), CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS
                  : [time] "r"(time + 1), [stcp_regaddr] "I"(CAPSENSE_SHIFT_STCP_IO), [stcp_bit] "I"(CAPSENSE_SHIFT_STCP_BIT), CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS, "0"(arrayp)
                  : "memory");
+    uint8_t value_at_time = CAPSENSE_READ_ROWS_VALUE;
+    if (interference_ptr) {
+        uint16_t p0 = 0;
+        CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY;
+        uint8_t interference = CAPSENSE_READ_ROWS_VALUE;
+#if CAPSENSE_INTERFERENCE_SAMPLES > 1
+        interference |= baseline;
+#endif
+        *interference_ptr = interference;
+    }
+    return value_at_time;
+}
+
+uint8_t test_single(uint8_t col, uint16_t time, uint8_t *interference_ptr) {
+    shift_select_col_no_strobe(col);
+    uint8_t value_at_time = test_single_strobed(time, interference_ptr);
+    shift_select_nothing();
+    wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+    return value_at_time;
+}
+
+#if CAPSENSE_CAL_TIME_DOMAIN
+// Takes one sample before the STCP rising edge (the interference sample), and then one at each of the
+// first CAPSENSE_CAL_TIME_DOMAIN_SAMPLES iterations after it, with the same timing as the loop in
+// test_single_strobed(), so sample i + 1 is what test_single() would return with time = i.
+// array must have room for CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE * (CAPSENSE_CAL_TIME_DOMAIN_SAMPLES + 1) bytes.
+// Returns the last sample.
+static inline uint8_t test_window_strobed(uint8_t *array) {
+    uint16_t index;
+    CAPSENSE_READ_ROWS_LOCAL_VARS;
+    uint8_t *arrayp = array;
+    uint8_t  sreg;
+    asm volatile("ldi %A[index], 0"
+                 "\n\t"
+                 "ldi %B[index], 0"
+                 "\n\t"
+                 "in %[sreg], __SREG__"
+                 "\n\t"
+                 "cli"
+                 "\n\t" CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS "\n\t" CAPSENSE_READ_ROWS_STORE_TO_ARRAY_INSTRUCTIONS "\n\t"
+                 "sbi %[stcp_regaddr], %[stcp_bit]"
+                 "\n\t"
+                 "1:" CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS "\n\t" CAPSENSE_READ_ROWS_STORE_TO_ARRAY_INSTRUCTIONS "\n\t"
+                 "adiw %A[index], 0x01"
+                 "\n\t"
+                 "cp %A[index], %A[time]"
+                 "\n\t"
+                 "cpc %B[index], %B[time]"
+                 "\n\t"
+                 "brlo 1b"
+                 "\n\t"
+                 "out __SREG__, %[sreg]"
+                 "\n\t"
+                 "cbi %[stcp_regaddr], %[stcp_bit]"
+                 "\n\t"
+                 : [arr] "=e"(arrayp), [index] "=&w"(index), [sreg] "=&r"(sreg), CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS
+                 : [time] "r"((uint16_t)CAPSENSE_CAL_TIME_DOMAIN_SAMPLES), [stcp_regaddr] "I"(CAPSENSE_SHIFT_STCP_IO), [stcp_bit] "I"(CAPSENSE_SHIFT_STCP_BIT), CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS, "0"(arrayp)
+                 : "memory");
+    return CAPSENSE_READ_ROWS_VALUE;
+}
+
+static void test_window(uint8_t col, uint8_t *array) {
+    shift_select_col_no_strobe(col);
+    test_window_strobed(array);
     shift_select_nothing();
     wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+}
+
+// Decodes one sample of the window captured by test_window_strobed(). Sample 0 is the one before the
+// STCP rising edge.
+static inline uint8_t window_value(const uint8_t *array, uint8_t sample) {
+    CAPSENSE_READ_ROWS_LOCAL_VARS;
+    uint16_t p0 = sample * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE;
+    CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY;
+    return CAPSENSE_READ_ROWS_VALUE;
+}
+#endif
+
+#if CAPSENSE_SAMPLE_CYCLE_ACCURATE
+uint8_t capsense_sample_cycles = CAPSENSE_HARDCODED_SAMPLE_CYCLES;
+
+// Same as test_single_strobed(), but the rows are sampled exactly `cycles` CPU cycles after the STCP
+// rising edge (at least 2). Instead of a loop, it jumps into a sled of CAPSENSE_SAMPLE_CYCLES_MAX nops,
+// as far from its end as the number of cycles that have to be waited, so any cycle can be selected
+// at runtime.
+static inline uint8_t test_single_strobed_cycles(uint8_t cycles, uint8_t *interference_ptr) {
+    uint8_t nops = (cycles < 2) ? 0 : (cycles - 2); // ijmp takes 2 cycles
+    if (nops > CAPSENSE_SAMPLE_CYCLES_MAX) nops = CAPSENSE_SAMPLE_CYCLES_MAX;
+    uint16_t target;
+    CAPSENSE_READ_ROWS_LOCAL_VARS;
+    uint8_t  array[CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE]; // the sample before triggering
+    uint8_t *arrayp = array;
+    uint8_t  sreg;
+#if CAPSENSE_INTERFERENCE_SAMPLES > 1
+    uint8_t baseline = interference_ptr ? read_rows_baseline() : 0;
+#endif
+    asm volatile("ldi %A[target], lo8(pm(2f))"
+                 "\n\t"
+                 "ldi %B[target], hi8(pm(2f))"
+                 "\n\t"
+                 "sub %A[target], %[nops]"
+                 "\n\t"
+                 "sbc %B[target], __zero_reg__"
+                 "\n\t"
+                 "in %[sreg], __SREG__"
+                 "\n\t"
+                 "cli"
+                 "\n\t" CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS "\n\t" CAPSENSE_READ_ROWS_STORE_TO_ARRAY_INSTRUCTIONS "\n\t"
+                 "sbi %[stcp_regaddr], %[stcp_bit]"
+                 "\n\t"
+                 "ijmp"
+                 "\n\t"
+                 ".rept %[max_nops]"
+                 "\n\t"
+                 "nop"
+                 "\n\t"
+                 ".endr"
+                 "\n"
+                 "2:" CAPSENSE_READ_ROWS_ASM_INSTRUCTIONS "\n\t"
+                 "out __SREG__, %[sreg]"
+                 "\n\t"
+                 "cbi %[stcp_regaddr], %[stcp_bit]"
+                 "\n\t"
+                 : [arr] "=e"(arrayp), [target] "=&z"(target), [sreg] "=&r"(sreg), CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS
+                 : [nops] "r"(nops), [max_nops] "n"(CAPSENSE_SAMPLE_CYCLES_MAX), [stcp_regaddr] "I"(CAPSENSE_SHIFT_STCP_IO), [stcp_bit] "I"(CAPSENSE_SHIFT_STCP_BIT), CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS, "0"(arrayp)
+                 : "memory");
     uint8_t value_at_time = CAPSENSE_READ_ROWS_VALUE;
     if (interference_ptr) {
         uint16_t p0 = 0;
         CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY;
         uint8_t interference = CAPSENSE_READ_ROWS_VALUE;
-        *interference_ptr    = interference;
+#if CAPSENSE_INTERFERENCE_SAMPLES > 1
+        interference |= baseline;
+#endif
+        *interference_ptr = interference;
     }
     return value_at_time;
 }
 
+uint8_t test_single_cycles(uint8_t col, uint8_t cycles, uint8_t *interference_ptr) {
+    shift_select_col_no_strobe(col);
+    uint8_t value_at_time = test_single_strobed_cycles(cycles, interference_ptr);
+    shift_select_nothing();
+    wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+    return value_at_time;
+}
+
+// Sample times used by the scan and the calibration are in CPU cycles:
+#    define SCAN_SAMPLE_TIME capsense_sample_cycles
+#    define SAMPLE_TIME_FROM_ITERATIONS(time) ((uint8_t)(((time) * SAMPLE_LOOP_CYCLES > 255) ? 255 : ((time) * SAMPLE_LOOP_CYCLES)))
+#else
+// Sample times used by the scan and the calibration are in test_single() loop iterations:
+#    define SCAN_SAMPLE_TIME CAPSENSE_HARDCODED_SAMPLE_TIME
+#    define SAMPLE_TIME_FROM_ITERATIONS(time) (time)
+#endif
+
+// Samples the column that's already loaded into the shift register, at SCAN_SAMPLE_TIME.
+static inline uint8_t sample_strobed(uint8_t *interference_ptr) {
+#if CAPSENSE_SAMPLE_CYCLE_ACCURATE
+    return test_single_strobed_cycles(SCAN_SAMPLE_TIME, interference_ptr);
+#else
+    return test_single_strobed(SCAN_SAMPLE_TIME, interference_ptr);
+#endif
+}
+
+// Selects a column, and samples it at `time` (in the units of SCAN_SAMPLE_TIME).
+static uint8_t sample_col(uint8_t col, uint8_t time, uint8_t *interference_ptr) {
+#if CAPSENSE_SAMPLE_CYCLE_ACCURATE
+    return test_single_cycles(col, time, interference_ptr);
+#else
+    return test_single(col, time, interference_ptr);
+#endif
+}
+
+#if CAPSENSE_SHIFT_WALKING_ONE
+// Walking-one column stepping: the shift register is loaded once per pass, and then the selected bit
+// is moved up by one SHCP clock per physical column. Columns that are not scanned (e.g. physical
+// columns 2 and 3 on this board) just cost extra clocks. If the next column is not above the current
+// one, the pattern is simply reloaded. Note that the previous column is deselected by the same STCP
+// edge that selects the next one, and the settle time is only waited at the end of the pass.
+static uint8_t shift_walk_col = 0xff;
+
+static inline void shift_walk_to(uint8_t col) {
+    if ((shift_walk_col == 0xff) || (col <= shift_walk_col)) {
+        shift_select_col_no_strobe(col);
+    } else {
+        shift_bus_release();
+        writePin(CAPSENSE_SHIFT_DIN, 0);
+        for (; shift_walk_col < col; shift_walk_col++) {
+            writePin(CAPSENSE_SHIFT_SHCP, 1);
+            writePin(CAPSENSE_SHIFT_SHCP, 0);
+        }
+    }
+    shift_walk_col = col;
+}
+#endif
+
+static inline void scan_pass_begin(void) {
+#if CAPSENSE_SHIFT_WALKING_ONE
+    shift_walk_col = 0xff;
+#endif
+}
+
+static inline uint8_t scan_sample_col(uint8_t physical_col, uint8_t *interference_ptr) {
+#if CAPSENSE_SHIFT_WALKING_ONE
+    shift_walk_to(physical_col);
+    return sample_strobed(interference_ptr);
+#else
+    return sample_col(physical_col, SCAN_SAMPLE_TIME, interference_ptr);
+#endif
+}
+
+#if CAPSENSE_CAL_TIME_DOMAIN
+static uint8_t scan_window[CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE * (CAPSENSE_CAL_TIME_DOMAIN_SAMPLES + 1)];
+
+// Captures a whole window of samples of a column into scan_window.
+static inline void scan_capture_col(uint8_t physical_col) {
+#    if CAPSENSE_SHIFT_WALKING_ONE
+    shift_walk_to(physical_col);
+    test_window_strobed(scan_window);
+#    else
+    test_window(physical_col, scan_window);
+#    endif
+}
+#endif
+
+static inline void scan_pass_end(void) {
+#if CAPSENSE_SHIFT_WALKING_ONE
+    if (shift_walk_col != 0xff) {
+        shift_select_nothing();
+        wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+        shift_walk_col = 0xff;
+    }
+#endif
+}
+
 #ifndef NO_PRINT
 #    define NRTIMES 64
 #    define TESTATONCE 8
@@ -373,7 +835,7 @@ void test_v2(void) {
 }
 #endif
 
-#define TRACKING_TEST_TIME 4
+#define TRACKING_TEST_TIME SAMPLE_TIME_FROM_ITERATIONS(4)
 // Key 1 is the always non-pressed key under the space bar to the right.
 #define TRACKING_KEY_1_COL 6
 #define TRACKING_KEY_1_ROW 4
@@ -401,7 +863,7 @@ uint16_t measure_middle(uint8_t col, uint8_t row, uint8_t time, uint8_t reps) {
         uint8_t sum = 0;
         uint8_t i;
         for (i = 0; i < reps; i++) {
-            sum += (test_single(col, time, NULL) >> row) & 1;
+            sum += (sample_col(col, time, NULL) >> row) & 1;
         }
         if (sum < reps_div2) {
             max = mid - 1;
@@ -414,7 +876,7 @@ uint16_t measure_middle(uint8_t col, uint8_t row, uint8_t time, uint8_t reps) {
 }
 
 uint16_t measure_middle_keymap_coords(uint8_t col, uint8_t row, uint8_t time, uint8_t reps) {
-    return measure_middle(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col), CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row), time, reps);
+    return measure_middle(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col), CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row), SAMPLE_TIME_FROM_ITERATIONS(time), reps);
 }
 
 uint16_t measure_middle_settled(uint8_t col, uint8_t row, uint8_t reps) {
@@ -438,6 +900,49 @@ uint16_t measure_middle_settled(uint8_t col, uint8_t row, uint8_t reps) {
     return min;
 }
 
+#if CAPSENSE_RAPID_TRIGGER || CAPSENSE_DRIFT_COMPENSATION
+// Follows the signal level of a single key with delta modulation: each step samples the key with the
+// DAC at dac, and moves dac towards the key's level, by a step that grows by half while it keeps going
+// the same way, and halves when it turns around. (Doubling the step would make it overshoot and
+// oscillate around a steady level.) Interfered samples are skipped.
+typedef struct {
+    uint16_t dac;  // tracked level, in DAC units
+    int8_t   step; // next step, negative if the last step went down
+} level_tracker_t;
+
+#    define LEVEL_TRACKER_STEP_MAX 64
+
+static void level_tracker_init(level_tracker_t *t, uint8_t physical_col, uint8_t physical_row) {
+    t->dac  = measure_middle(physical_col, physical_row, SCAN_SAMPLE_TIME, CAPSENSE_CAL_EACHKEY_REPS);
+    t->step = 1;
+}
+
+static void level_tracker_step(level_tracker_t *t, uint8_t physical_col, uint8_t row_mask) {
+    uint8_t interference;
+    dac_write_threshold(t->dac);
+    bool above = sample_col(physical_col, SCAN_SAMPLE_TIME, &interference) & row_mask;
+    if (interference & row_mask) return;
+    int8_t step = t->step;
+    if (above == (step > 0)) {
+        if (step > 0) {
+            step += (step + 1) / 2;
+            if (step > LEVEL_TRACKER_STEP_MAX) step = LEVEL_TRACKER_STEP_MAX;
+        } else {
+            step -= (1 - step) / 2;
+            if (step < -LEVEL_TRACKER_STEP_MAX) step = -LEVEL_TRACKER_STEP_MAX;
+        }
+    } else {
+        step = (step > 0) ? -((step + 1) / 2) : ((1 - step) / 2);
+    }
+    t->step = step;
+    if (step < 0) {
+        t->dac = (t->dac < (uint8_t)-step) ? 0 : t->dac + step;
+    } else {
+        t->dac = (t->dac + step > CAPSENSE_DAC_MAX) ? CAPSENSE_DAC_MAX : t->dac + step;
+    }
+}
+#endif
+
 #ifndef NO_PRINT
 void tracking_test(void) {
     int i;
@@ -487,13 +992,13 @@ uint16_t calibration_measure_all_valid_keys(uint8_t time, uint8_t reps, bool loo
             uint8_t i;
             for (i = 0; i < reps; i++) {
                 if (looking_for_all_zero) {
-                    uint8_t all_zero = (test_single(physical_col, time, NULL) & valid_physical_rows) == 0;
+                    uint8_t all_zero = (sample_col(physical_col, time, NULL) & valid_physical_rows) == 0;
                     if (!all_zero) {
                         min = mid + 1;
                         goto next_binary_search;
                     }
                 } else {
-                    uint8_t all_ones = (test_single(physical_col, time, NULL) & valid_physical_rows) == valid_physical_rows;
+                    uint8_t all_ones = (sample_col(physical_col, time, NULL) & valid_physical_rows) == valid_physical_rows;
                     if (!all_ones) {
                         max = mid - 1;
                         goto next_binary_search;
@@ -517,30 +1022,704 @@ uint16_t calibration_measure_all_valid_keys(uint8_t time, uint8_t reps, bool loo
 #    endif
 #endif
 
-uint16_t     cal_thresholds[CAPSENSE_CAL_BINS];
-matrix_row_t assigned_to_threshold[CAPSENSE_CAL_BINS][MATRIX_CAPSENSE_ROWS];
-#ifndef NO_PRINT
-static uint16_t cal_tr_allzero;
-static uint16_t cal_tr_allone;
+uint16_t cal_thresholds[CAPSENSE_CAL_BINS];
+#if CAPSENSE_CAL_HYSTERESIS
+// With hysteresis, cal_thresholds are the press thresholds, and keys that are pressed are sampled
+// again at the release threshold of their bin, which is closer to the level of keys at rest.
+uint16_t cal_release_thresholds[CAPSENSE_CAL_BINS];
 #endif
-void calibration(void) {
-    uint16_t cal_thresholds_max[CAPSENSE_CAL_BINS];
-    uint16_t cal_thresholds_min[CAPSENSE_CAL_BINS];
-    memset(cal_thresholds_max, 0xff, sizeof(cal_thresholds_max));
-    memset(cal_thresholds_min, 0xff, sizeof(cal_thresholds_min));
-#ifdef NO_PRINT
-    uint16_t cal_tr_allzero;
-    uint16_t cal_tr_allone;
+#if CAPSENSE_SCAN_VOTING
+// Keys whose calibrated level is within CAPSENSE_SCAN_VOTING_MARGIN of their threshold, as a mask of
+// physical rows for each keymap column. Their transitions are only applied after a vote.
+static uint8_t scan_marginal_cols[MATRIX_COLS];
+uint8_t        capsense_marginal_keys;
 #endif
-    cal_tr_allzero = calibration_measure_all_valid_keys(CAPSENSE_HARDCODED_SAMPLE_TIME, CAPSENSE_CAL_INIT_REPS, true);
-    cal_tr_allone  = calibration_measure_all_valid_keys(CAPSENSE_HARDCODED_SAMPLE_TIME, CAPSENSE_CAL_INIT_REPS, false);
-    uint16_t max   = (cal_tr_allzero == 0) ? 0 : (cal_tr_allzero - 1);
-    uint16_t min   = cal_tr_allone + 1;
-    if (max < min) max = min;
-    uint16_t d = max - min;
-    uint8_t  i;
-    for (i = 0; i < CAPSENSE_CAL_BINS; i++) {
-        cal_thresholds[i] = min + (d * (2 * i + 1)) / 2 / CAPSENSE_CAL_BINS;
+
+// The scan schedule is a flat list of (column, rows) slots, grouped into bins that share a DAC
+// threshold. It is built once, at the end of calibration (or at init, without calibration), and
+// contains only the bins, columns and rows that have keys assigned, so that matrix_scan_raw()
+// doesn't need to look at anything else.
+// With time-domain calibration, each bin is further divided by the sample time of the keys.
+// With hot-key priority scanning, the schedule has two parts: the hot keys' bins, then the others'.
+#if CAPSENSE_SCAN_HOT_KEYS
+#    define SCAN_PARTS 2
+#else
+#    define SCAN_PARTS 1
+#endif
+#if CAPSENSE_CAL_ENABLED
+#    if CAPSENSE_CAL_TIME_DOMAIN
+#        define SCAN_BINS CAPSENSE_CAL_TIME_DOMAIN_LEVELS
+#        define SCAN_BIN_TIMES CAPSENSE_CAL_TIME_DOMAIN_SAMPLES
+#    else
+#        define SCAN_BINS CAPSENSE_CAL_BINS
+#        define SCAN_BIN_TIMES 1
+#    endif
+#    if SCAN_PARTS * SCAN_BINS * SCAN_BIN_TIMES < MATRIX_CAPSENSE_ROWS
+#        define SCAN_SLOTS (MATRIX_COLS * SCAN_PARTS * SCAN_BINS * SCAN_BIN_TIMES)
+#    else
+#        define SCAN_SLOTS (MATRIX_COLS * MATRIX_CAPSENSE_ROWS)
+#    endif
+#else
+#    define SCAN_BINS 1
+#    define SCAN_BIN_TIMES 1
+#    define SCAN_SLOTS (MATRIX_COLS * SCAN_PARTS)
+#endif
+
+typedef struct {
+#if CAPSENSE_CAL_TIME_DOMAIN
+    uint8_t col : 5;  // keymap column
+    uint8_t time : 3; // sample time, in test_single() loop iterations
+#else
+    uint8_t col; // keymap column
+#endif
+    uint8_t rows; // physical rows to sample, as a bit mask
+} scan_slot_t;
+
+typedef struct {
+    uint8_t cal_bin; // index into cal_thresholds
+    uint8_t end;     // this bin's slots end where the next bin's slots start
+} scan_bin_t;
+
+static scan_slot_t scan_slots[SCAN_SLOTS];
+static scan_bin_t  scan_bins[SCAN_BINS * SCAN_PARTS];
+static uint8_t     scan_bin_count;
+#if CAPSENSE_SCAN_HOT_KEYS
+static uint8_t scan_hot_end; // the hot keys' slots end where the other keys' slots start
+#endif
+
+static inline uint8_t scan_slot_count(void) {
+    return scan_bin_count ? scan_bins[scan_bin_count - 1].end : 0;
+}
+
+// Returns the bin that contains the slot.
+static inline uint8_t scan_bin_of_slot(uint8_t slot) {
+    uint8_t bin = 0;
+    while (scan_bins[bin].end <= slot) bin++;
+    return bin;
+}
+
+// The scanner keeps its own copy of the matrix in column-major order, one byte of physical rows per
+// keymap column, which is the order the samples come in, and only updates it where a slot's sample
+// differs from the previous scan. Columns that were updated are marked in scan_dirty_cols, and only
+// those are transposed into QMK's row-major matrix.
+typedef struct {
+    uint8_t cols[MATRIX_COLS];
+#if MATRIX_EXTRA_DIRECT_ROWS
+    matrix_row_t direct_rows[MATRIX_EXTRA_DIRECT_ROWS];
+#endif
+} scan_state_t;
+
+static scan_state_t scan_state;
+static matrix_row_t scan_dirty_cols;
+
+#if CAPSENSE_EVENT_QUEUE
+// Event queue: the scan ISR pushes every transition of the scan state, with the time it was seen,
+// into a single-producer single-consumer ring buffer, and matrix_scan_custom() publishes them to QMK
+// one per scan, in the order they happened, so that a slow main loop doesn't merge or reorder them.
+// Only the ISR writes scan_event_head, and only the main loop writes scan_event_tail, so no locking is
+// needed. If the queue overflows, the events are dropped, and the main loop resynchronizes the whole
+// matrix once it gets to it.
+typedef struct {
+    uint8_t  row; // keymap row, with SCAN_EVENT_PRESSED set for a press
+    uint8_t  col;
+    uint16_t time; // timer_read() when the scan saw the transition
+} scan_event_t;
+
+#    define SCAN_EVENT_PRESSED 0x80
+
+static volatile scan_event_t scan_event_queue[CAPSENSE_EVENT_QUEUE_SIZE];
+static volatile uint8_t      scan_event_head;
+static volatile uint8_t      scan_event_tail;
+static volatile bool         scan_event_lost;
+volatile uint16_t            capsense_event_overflows; // events dropped because the queue was full
+uint16_t                     capsense_event_time;      // scan time of the last event published to QMK
+
+static void scan_event_push(uint8_t row, uint8_t col, bool pressed) {
+    uint8_t head = scan_event_head;
+    uint8_t next = (head + 1) & (CAPSENSE_EVENT_QUEUE_SIZE - 1);
+    if (next == scan_event_tail) {
+        capsense_event_overflows++;
+        scan_event_lost = true;
+        return;
+    }
+    scan_event_queue[head].row  = row | (pressed ? SCAN_EVENT_PRESSED : 0);
+    scan_event_queue[head].col  = col;
+    scan_event_queue[head].time = timer_read();
+    scan_event_head             = next;
+}
+#endif
+
+// nibble_to_lanes[n] has bit i of n in the lowest bit of byte i.
+static const uint32_t PROGMEM nibble_to_lanes[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101,
+};
+
+// Copies the columns in cols_mask from the scan state into row-major rows. Each group of 8 columns
+// is an 8x8 bit transpose: both nibbles of each column byte are spread over four bytes with a table
+// lookup, and shifted in one column at a time, so that each byte ends up holding one row.
+static void scan_state_to_rows(const scan_state_t *state, matrix_row_t rows[], matrix_row_t cols_mask) {
+    uint8_t group, row;
+    for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+        rows[row] &= ~cols_mask;
+    }
+    for (group = 0; group < (MATRIX_COLS + 7) / 8; group++) {
+        uint8_t group_mask = cols_mask >> (8 * group);
+        if (!group_mask) continue;
+        uint32_t lo = 0, hi = 0;
+        int8_t   col;
+        for (col = 7; col >= 0; col--) {
+            uint8_t c = (8 * group + col < MATRIX_COLS) ? state->cols[8 * group + col] : 0;
+            lo        = (lo << 1) | pgm_read_dword(&nibble_to_lanes[c & 0xf]);
+            hi        = (hi << 1) | pgm_read_dword(&nibble_to_lanes[c >> 4]);
+        }
+        uint8_t lanes[8];
+        uint8_t physical_row;
+        for (physical_row = 0; physical_row < 4; physical_row++) {
+            lanes[physical_row]     = lo;
+            lanes[physical_row + 4] = hi;
+            lo >>= 8;
+            hi >>= 8;
+        }
+        for (physical_row = 0; physical_row < MATRIX_CAPSENSE_ROWS; physical_row++) {
+            rows[CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(physical_row)] |= ((matrix_row_t)(lanes[physical_row] & group_mask)) << (8 * group);
+        }
+    }
+#if MATRIX_EXTRA_DIRECT_ROWS
+    for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+        rows[MATRIX_CAPSENSE_ROWS + row] = (rows[MATRIX_CAPSENSE_ROWS + row] & ~cols_mask) | (state->direct_rows[row] & cols_mask);
+    }
+#endif
+}
+
+#if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
+static bool scan_state_to_rows_ok = true;
+
+static uint16_t self_check_random(uint16_t *x) {
+    *x ^= *x << 7;
+    *x ^= *x >> 9;
+    *x ^= *x << 8;
+    return *x;
+}
+
+// Compares scan_state_to_rows() with a bit-by-bit version, for pseudo-random states, column masks,
+// and previous contents of the rows. Columns past MATRIX_COLS are left out.
+static void scan_state_to_rows_self_check(void) {
+    const matrix_row_t valid = (MATRIX_COLS >= 8 * sizeof(matrix_row_t)) ? ~(matrix_row_t)0 : ((matrix_row_t)1 << (MATRIX_COLS % (8 * sizeof(matrix_row_t)))) - 1;
+    scan_state_t       state;
+    matrix_row_t       rows[MATRIX_ROWS], expected[MATRIX_ROWS];
+    uint16_t           x = 0xace1;
+    uint8_t            n, col, row, physical_row;
+    for (n = 0; n < 64; n++) {
+        for (col = 0; col < MATRIX_COLS; col++) {
+            state.cols[col] = self_check_random(&x);
+        }
+        for (row = 0; row < MATRIX_ROWS; row++) {
+            rows[row]     = ((((matrix_row_t)self_check_random(&x)) << 8) ^ self_check_random(&x)) & valid;
+            expected[row] = rows[row];
+        }
+#    if MATRIX_EXTRA_DIRECT_ROWS
+        for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+            state.direct_rows[row] = ((((matrix_row_t)self_check_random(&x)) << 8) ^ self_check_random(&x)) & valid;
+        }
+#    endif
+        matrix_row_t cols_mask = (n == 0) ? valid : (((((matrix_row_t)self_check_random(&x)) << 8) ^ self_check_random(&x)) & valid);
+        scan_state_to_rows(&state, rows, cols_mask);
+        for (col = 0; col < MATRIX_COLS; col++) {
+            matrix_row_t bit = (matrix_row_t)1 << col;
+            if (!(cols_mask & bit)) continue;
+            for (physical_row = 0; physical_row < MATRIX_CAPSENSE_ROWS; physical_row++) {
+                row = CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(physical_row);
+                expected[row] &= ~bit;
+                if (state.cols[col] & (1 << physical_row)) expected[row] |= bit;
+            }
+#    if MATRIX_EXTRA_DIRECT_ROWS
+            for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+                expected[MATRIX_CAPSENSE_ROWS + row] = (expected[MATRIX_CAPSENSE_ROWS + row] & ~bit) | (state.direct_rows[row] & bit);
+            }
+#    endif
+        }
+        if (memcmp(rows, expected, sizeof(rows)) != 0) scan_state_to_rows_ok = false;
+    }
+}
+#endif
+
+#if CAPSENSE_SCAN_HOT_KEYS
+static const uint16_t PROGMEM scan_hot_keycodes[] = {CAPSENSE_SCAN_HOT_KEYCODES};
+
+// Hot keys are the ones whose layer 0 keycode is a modifier, or is in CAPSENSE_SCAN_HOT_KEYCODES.
+static bool scan_is_hot_key(uint8_t row, uint8_t col) {
+    uint16_t keycode = pgm_read_word(&keymaps[0][row][col]);
+    uint8_t  i;
+    if (keycode >= KC_LCTL && keycode <= KC_RGUI) return true;
+    for (i = 0; i < sizeof(scan_hot_keycodes) / sizeof(scan_hot_keycodes[0]); i++) {
+        if (keycode == pgm_read_word(&scan_hot_keycodes[i])) return true;
+    }
+    return false;
+}
+#endif
+
+#if CAPSENSE_RAPID_TRIGGER
+// Rapid trigger keys aren't in the scan schedule. Each of them has its signal level tracked with
+// CAPSENSE_RAPID_TRIGGER_STEPS level tracker steps per pass, and is pressed or released when the level
+// moves CAPSENSE_RAPID_TRIGGER_DELTA away from its lowest level since the last release, or from its
+// highest level since the last press. Levels are in DAC units, in the direction of a key press.
+typedef struct {
+    uint8_t         col;      // keymap column
+    uint8_t         row_mask; // physical row, as a bit mask
+    level_tracker_t track;
+    uint16_t        rest;    // level with the key at rest, measured during calibration
+    uint16_t        extreme; // lowest level since the last release, or highest since the last press
+} rapid_key_t;
+
+static const uint16_t PROGMEM rapid_keycodes[] = {CAPSENSE_RAPID_TRIGGER_KEYCODES};
+static rapid_key_t            rapid_keys[CAPSENSE_RAPID_TRIGGER_MAX_KEYS];
+static uint8_t                rapid_key_count;
+
+// Fills rapid_keys with the first CAPSENSE_RAPID_TRIGGER_MAX_KEYS keys whose layer 0 keycode is in
+// CAPSENSE_RAPID_TRIGGER_KEYCODES, and marks them in rapid (by keymap row).
+static void rapid_keys_find(matrix_row_t rapid[MATRIX_CAPSENSE_ROWS]) {
+    uint8_t row, col, i;
+    rapid_key_count = 0;
+    for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+        rapid[row] = 0;
+        for (col = 0; col < MATRIX_COLS; col++) {
+            uint16_t keycode = pgm_read_word(&keymaps[0][row][col]);
+            if (rapid_key_count == CAPSENSE_RAPID_TRIGGER_MAX_KEYS) break;
+            for (i = 0; i < sizeof(rapid_keycodes) / sizeof(rapid_keycodes[0]); i++) {
+                if (keycode == pgm_read_word(&rapid_keycodes[i])) break;
+            }
+            if (i == sizeof(rapid_keycodes) / sizeof(rapid_keycodes[0])) continue;
+            rapid_keys[rapid_key_count].col      = col;
+            rapid_keys[rapid_key_count].row_mask = 1 << CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row);
+            rapid_key_count++;
+            rapid[row] |= ((matrix_row_t)1) << col;
+        }
+    }
+}
+
+#    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS
+#        define RAPID_LEVEL(dac) (dac)
+#    else
+#        define RAPID_LEVEL(dac) (CAPSENSE_DAC_MAX - (dac))
+#    endif
+
+// Measures the level of each rapid trigger key at rest, and starts tracking it from there.
+static void rapid_keys_calibrate(void) {
+    uint8_t i;
+    for (i = 0; i < rapid_key_count; i++) {
+        rapid_key_t *key = &rapid_keys[i];
+        uint8_t      physical_row;
+        for (physical_row = 0; !(key->row_mask & (1 << physical_row)); physical_row++)
+            ;
+        level_tracker_init(&key->track, CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(key->col), physical_row);
+        key->rest    = RAPID_LEVEL(key->track.dac);
+        key->extreme = key->rest;
+    }
+}
+#endif
+
+// Fills order with the keymap columns in a CAPSENSE_COL_ORDER_* order. Except for the keymap order,
+// the orders are based on the physical column order, since that's how the drive lines are laid out:
+// interleaved scans every other column and then the ones in between, and farthest-first alternates
+// between the two halves of the board, so that consecutive columns are never next to each other.
+static void scan_col_order(uint8_t kind, uint8_t order[MATRIX_COLS]) {
+    uint8_t sorted[MATRIX_COLS];
+    uint8_t half = (MATRIX_COLS + 1) / 2;
+    uint8_t i, j;
+    for (i = 0; i < MATRIX_COLS; i++) {
+        order[i] = i;
+    }
+    if (kind == CAPSENSE_COL_ORDER_KEYMAP) return;
+    for (i = 0; i < MATRIX_COLS; i++) {
+        for (j = i; j > 0 && CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(sorted[j - 1]) > CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(i); j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = i;
+    }
+    for (i = 0; i < MATRIX_COLS; i++) {
+        if (kind == CAPSENSE_COL_ORDER_INTERLEAVED) {
+            order[i] = sorted[(i < half) ? 2 * i : 2 * (i - half) + 1];
+        } else {
+            order[i] = sorted[(i & 1) ? half + i / 2 : i / 2];
+        }
+    }
+}
+
+// key_bin[row][col] is the calibration bin of each key (in keymap coordinates), or 0xff for no key.
+// With time-domain calibration it is bin * SCAN_BIN_TIMES + the sample time of the key.
+// Within each bin, the columns are scanned in CAPSENSE_SCAN_COL_ORDER.
+static void scan_schedule_build(uint8_t key_bin[MATRIX_CAPSENSE_ROWS][MATRIX_COLS]) {
+    uint8_t slot = 0;
+    uint8_t part, bin, col, row, time, i;
+    uint8_t order[MATRIX_COLS];
+    scan_col_order(CAPSENSE_SCAN_COL_ORDER, order);
+#if CAPSENSE_SCAN_HOT_KEYS
+    matrix_row_t hot[MATRIX_CAPSENSE_ROWS];
+    for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+        hot[row] = 0;
+        for (col = 0; col < MATRIX_COLS; col++) {
+            if (scan_is_hot_key(row, col)) hot[row] |= ((matrix_row_t)1) << col;
+        }
+    }
+#endif
+#if CAPSENSE_RAPID_TRIGGER
+    matrix_row_t rapid[MATRIX_CAPSENSE_ROWS];
+    rapid_keys_find(rapid);
+#endif
+    scan_bin_count = 0;
+    memset(scan_state.cols, 0, sizeof(scan_state.cols));
+    scan_dirty_cols = ~(matrix_row_t)0;
+    for (part = 0; part < SCAN_PARTS; part++) {
+        for (bin = 0; bin < SCAN_BINS; bin++) {
+            uint8_t first_slot = slot;
+            for (i = 0; i < MATRIX_COLS; i++) {
+                col = order[i];
+                for (time = 0; time < SCAN_BIN_TIMES; time++) {
+                    uint8_t rows = 0;
+                    for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+#if CAPSENSE_SCAN_HOT_KEYS
+                        bool is_hot = (hot[row] >> col) & 1;
+                        if (is_hot != (part == 0)) continue;
+#endif
+#if CAPSENSE_RAPID_TRIGGER
+                        if ((rapid[row] >> col) & 1) continue;
+#endif
+                        if (key_bin[row][col] == bin * SCAN_BIN_TIMES + time) {
+                            rows |= 1 << CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row);
+                        }
+                    }
+                    if (rows) {
+                        scan_slots[slot].col = col;
+#if CAPSENSE_CAL_TIME_DOMAIN
+                        scan_slots[slot].time = time;
+#endif
+                        scan_slots[slot].rows = rows;
+                        slot++;
+                    }
+                }
+            }
+            if (slot != first_slot) {
+                scan_bins[scan_bin_count].cal_bin = bin;
+                scan_bins[scan_bin_count].end     = slot;
+                scan_bin_count++;
+            }
+        }
+#if CAPSENSE_SCAN_HOT_KEYS
+        if (part == 0) scan_hot_end = slot;
+#endif
+    }
+}
+
+void get_assigned_to_threshold(uint8_t cal_bin, matrix_row_t assigned[MATRIX_CAPSENSE_ROWS]) {
+    uint8_t bin, slot = 0;
+    memset(assigned, 0, sizeof(matrix_row_t) * MATRIX_CAPSENSE_ROWS);
+    for (bin = 0; bin < scan_bin_count; bin++) {
+        for (; slot < scan_bins[bin].end; slot++) {
+            if (scan_bins[bin].cal_bin == cal_bin) {
+                uint8_t row;
+                for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+                    if (scan_slots[slot].rows & (1 << CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row))) {
+                        assigned[row] |= ((matrix_row_t)1) << scan_slots[slot].col;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#if !CAPSENSE_CAL_ENABLED
+static void scan_schedule_build_uncalibrated(void) {
+    uint8_t key_bin[MATRIX_CAPSENSE_ROWS][MATRIX_COLS];
+    uint8_t col, row;
+    for (col = 0; col < MATRIX_COLS; col++) {
+        for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+            key_bin[row][col] = (pgm_read_word(&keymaps[0][row][col]) != KC_NO) ? 0 : 0xff;
+        }
+    }
+    scan_schedule_build(key_bin);
+}
+#endif
+
+#if CAPSENSE_SETTLE_DIAGNOSTIC
+// Settle time diagnostic: for each column order, finds the shortest wait after deselecting a column
+// that doesn't change what the next column of the same bin reads, compared to a long wait, using
+// test_multiple() captures. The result is the worst case over all consecutive pairs of columns, or
+// 0xff if some pair doesn't settle within CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US. Only the keys that the
+// schedule actually samples are compared, at their sample time (rounded down to a loop iteration
+// with CAPSENSE_SAMPLE_CYCLE_ACCURATE), and only where the long-wait reads are stable themselves.
+#    if CAPSENSE_CAL_TIME_DOMAIN
+#        define SETTLE_DIAG_TIME_MAX (CAPSENSE_CAL_TIME_DOMAIN_SAMPLES - 1)
+#        define SETTLE_DIAG_SLOT_TIME(slot) (scan_slots[slot].time)
+#    elif CAPSENSE_SAMPLE_CYCLE_ACCURATE
+#        define SETTLE_DIAG_TIME_MAX ((CAPSENSE_SAMPLE_CYCLES_MAX + 2) / SAMPLE_LOOP_CYCLES)
+#        define SETTLE_DIAG_SLOT_TIME(slot) (capsense_sample_cycles / SAMPLE_LOOP_CYCLES)
+#    else
+#        define SETTLE_DIAG_TIME_MAX CAPSENSE_HARDCODED_SAMPLE_TIME
+#        define SETTLE_DIAG_SLOT_TIME(slot) CAPSENSE_HARDCODED_SAMPLE_TIME
+#    endif
+#    define SETTLE_DIAG_REFERENCE_US 500
+
+uint8_t capsense_settle_min_us[CAPSENSE_COL_ORDERS];
+
+// Selects and deselects column a, waits settle_us, and then captures column b (keymap columns). The
+// wait is timed with Timer1 like the scan's own settle times, so that it isn't stretched by the
+// overhead of a wait_us(1) loop.
+static void settle_diag_capture(uint8_t a, uint8_t b, uint16_t settle_us, uint8_t *window) {
+    shift_select_col(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(a));
+    wait_us(1);
+    shift_select_nothing();
+    scan_timer_wait_until(scan_timer_read() + SCAN_TIMER_US_TO_TICKS(settle_us));
+    test_multiple(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(b), SETTLE_DIAG_TIME_MAX, window);
+}
+
+// Returns the shortest settle time, starting at settle_us, after which column b reads the same as
+// after a long wait, for all of its slots in first_slot..end_slot.
+static uint8_t settle_diag_pair(uint8_t first_slot, uint8_t end_slot, uint8_t a, uint8_t b, uint8_t settle_us) {
+    uint8_t window[CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE * (SETTLE_DIAG_TIME_MAX + 1)];
+    uint8_t reference[SETTLE_DIAG_TIME_MAX + 1];
+    uint8_t stable[SETTLE_DIAG_TIME_MAX + 1];
+    uint8_t i, t, slot;
+    memset(stable, 0xff, sizeof(stable));
+    for (i = 0; i < CAPSENSE_SETTLE_DIAGNOSTIC_REPS; i++) {
+        settle_diag_capture(a, b, SETTLE_DIAG_REFERENCE_US, window);
+        for (t = 0; t <= SETTLE_DIAG_TIME_MAX; t++) {
+            if (i == 0) reference[t] = window[t];
+            stable[t] &= ~(window[t] ^ reference[t]);
+        }
+    }
+    for (; settle_us <= CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US; settle_us++) {
+        bool settled = true;
+        for (i = 0; i < CAPSENSE_SETTLE_DIAGNOSTIC_REPS && settled; i++) {
+            settle_diag_capture(a, b, settle_us, window);
+            for (slot = first_slot; slot < end_slot; slot++) {
+                if (scan_slots[slot].col != b) continue;
+                t = SETTLE_DIAG_SLOT_TIME(slot);
+                if ((window[t] ^ reference[t]) & stable[t] & scan_slots[slot].rows) settled = false;
+            }
+        }
+        if (settled) return settle_us;
+    }
+    return 0xff;
+}
+
+static bool settle_diag_bin_has_col(uint8_t first_slot, uint8_t end_slot, uint8_t col) {
+    uint8_t slot;
+    for (slot = first_slot; slot < end_slot; slot++) {
+        if (scan_slots[slot].col == col) return true;
+    }
+    return false;
+}
+
+static void settle_diagnostic(void) {
+    uint8_t kind;
+    for (kind = 0; kind < CAPSENSE_COL_ORDERS; kind++) {
+        uint8_t order[MATRIX_COLS];
+        uint8_t settle_us  = 0;
+        uint8_t first_slot = 0;
+        uint8_t bin;
+        scan_col_order(kind, order);
+        for (bin = 0; bin < scan_bin_count && settle_us != 0xff; bin++) {
+            uint8_t end_slot = scan_bins[bin].end;
+            uint8_t prev_col = 0xff;
+            uint8_t i;
+#    if CAPSENSE_CAL_ENABLED
+            dac_write_threshold(cal_thresholds[scan_bins[bin].cal_bin]);
+#    endif
+            for (i = 0; i < MATRIX_COLS && settle_us != 0xff; i++) {
+                if (!settle_diag_bin_has_col(first_slot, end_slot, order[i])) continue;
+                if (prev_col != 0xff) {
+                    settle_us = settle_diag_pair(first_slot, end_slot, prev_col, order[i], settle_us);
+                }
+                prev_col = order[i];
+            }
+            first_slot = end_slot;
+        }
+        capsense_settle_min_us[kind] = settle_us;
+    }
+}
+#endif
+
+#if CAPSENSE_CAL_TIME_DOMAIN
+// Time-domain calibration: instead of giving each key the DAC threshold that best matches its signal
+// level, the DAC is only set to a few levels (cal_thresholds[0..CAPSENSE_CAL_TIME_DOMAIN_LEVELS-1]),
+// and each key gets the level and the sample time where it reads 1 closest to half of the time,
+// because that's where its signal level matches the level. The scan later uses the level with the
+// usual CAPSENSE_CAL_THRESHOLD_OFFSET, at that sample time.
+static void calibration_time_domain(uint8_t key_bin[MATRIX_CAPSENSE_ROWS][MATRIX_COLS]) {
+    uint8_t window[CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE * (CAPSENSE_CAL_TIME_DOMAIN_SAMPLES + 1)];
+    uint8_t sums[MATRIX_CAPSENSE_ROWS][CAPSENSE_CAL_TIME_DOMAIN_SAMPLES];
+    uint8_t best_err[MATRIX_CAPSENSE_ROWS];
+    uint8_t col, row, level, time, i;
+    for (col = 0; col < MATRIX_COLS; col++) {
+        uint8_t physical_col = CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col);
+        memset(best_err, 0xff, sizeof(best_err));
+        for (level = 0; level < CAPSENSE_CAL_TIME_DOMAIN_LEVELS; level++) {
+            dac_write_threshold(cal_thresholds[level]);
+            memset(sums, 0, sizeof(sums));
+            for (i = 0; i < CAPSENSE_CAL_EACHKEY_REPS; i++) {
+                test_window(physical_col, window);
+                for (time = 0; time < CAPSENSE_CAL_TIME_DOMAIN_SAMPLES; time++) {
+                    uint8_t v = window_value(window, time + 1);
+                    for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+                        sums[row][time] += (v >> CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row)) & 1;
+                    }
+                }
+            }
+            for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+                if (pgm_read_word(&keymaps[0][row][col]) == KC_NO) continue;
+                for (time = 0; time < CAPSENSE_CAL_TIME_DOMAIN_SAMPLES; time++) {
+                    uint8_t err = (uint8_t)abs(2 * sums[row][time] - CAPSENSE_CAL_EACHKEY_REPS);
+                    if (err < best_err[row]) {
+                        best_err[row]     = err;
+                        key_bin[row][col] = level * CAPSENSE_CAL_TIME_DOMAIN_SAMPLES + time;
+                    }
+                }
+            }
+        }
+    }
+}
+#endif
+
+#ifndef NO_PRINT
+static uint16_t cal_tr_allzero;
+static uint16_t cal_tr_allone;
+#endif
+#if CAPSENSE_SUSPEND_SCAN
+static uint16_t suspend_threshold; // all keys at rest are CAPSENSE_CAL_THRESHOLD_OFFSET clear of this
+#endif
+#if CAPSENSE_DRIFT_COMPENSATION
+// Drift compensation: the reference keys in CAPSENSE_DRIFT_REF_KEYS (physical {col, row} pairs, which
+// must be KC_NO in layer 0 of the keymap, or outside of it; others are skipped, so that typing
+// can't move the thresholds) are followed by level trackers in the background, CAPSENSE_DRIFT_STEPS steps per pass, taking turns. Every
+// CAPSENSE_DRIFT_FILTER_PERIOD_MS, their levels go through a low-pass filter, with a time constant of
+// (1 << CAPSENSE_DRIFT_FILTER_SHIFT) periods, so that only slow changes get through, and all the
+// thresholds are shifted by the average change of the filtered levels since calibration.
+typedef struct {
+    level_tracker_t track;
+    uint8_t         col, row; // physical
+    uint16_t        baseline; // level at calibration
+    uint32_t        filtered; // low-pass filtered level, times 1 << CAPSENSE_DRIFT_FILTER_SHIFT
+} drift_ref_t;
+
+static const uint8_t PROGMEM drift_ref_keys[][2] = {CAPSENSE_DRIFT_REF_KEYS};
+#    define DRIFT_REFS (sizeof(drift_ref_keys) / sizeof(drift_ref_keys[0]))
+static drift_ref_t drift_refs[DRIFT_REFS];
+static uint8_t     drift_ref_count; // reference keys that passed drift_ref_unused()
+static uint8_t     drift_next_ref;
+static uint16_t    drift_filter_time; // timer_read() at the last filter update
+int16_t            capsense_cal_drift; // shift of the thresholds since calibration, in DAC units
+
+// Returns true if the physical key at col, row has no keycode in layer 0.
+static bool drift_ref_unused(uint8_t physical_col, uint8_t physical_row) {
+    uint8_t row = CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(physical_row);
+    uint8_t col;
+    if (row >= MATRIX_CAPSENSE_ROWS) return true;
+    for (col = 0; col < MATRIX_COLS; col++) {
+        if (CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col) == physical_col) {
+            return pgm_read_word(&keymaps[0][row][col]) == KC_NO;
+        }
+    }
+    return true;
+}
+
+static void drift_calibrate(void) {
+    uint8_t i;
+    drift_ref_count = 0;
+    for (i = 0; i < DRIFT_REFS; i++) {
+        drift_ref_t *ref = &drift_refs[drift_ref_count];
+        ref->col         = pgm_read_byte(&drift_ref_keys[i][0]);
+        ref->row         = pgm_read_byte(&drift_ref_keys[i][1]);
+        if (!drift_ref_unused(ref->col, ref->row)) continue;
+        level_tracker_init(&ref->track, ref->col, ref->row);
+        ref->baseline = ref->track.dac;
+        ref->filtered = (uint32_t)ref->track.dac << CAPSENSE_DRIFT_FILTER_SHIFT;
+        drift_ref_count++;
+    }
+    drift_next_ref     = 0;
+    drift_filter_time  = timer_read();
+    capsense_cal_drift = 0;
+}
+
+static inline uint16_t dac_shift(uint16_t value, int16_t delta) {
+    int16_t shifted = (int16_t)value + delta;
+    return (shifted < 0) ? 0 : (shifted > CAPSENSE_DAC_MAX) ? CAPSENSE_DAC_MAX : shifted;
+}
+
+static void drift_track(void) {
+    uint8_t n, i;
+    int16_t sum = 0;
+    if (!drift_ref_count) return;
+    for (n = 0; n < CAPSENSE_DRIFT_STEPS; n++) {
+        drift_ref_t *ref = &drift_refs[drift_next_ref];
+        level_tracker_step(&ref->track, ref->col, 1 << ref->row);
+        if (++drift_next_ref == drift_ref_count) drift_next_ref = 0;
+    }
+    if (timer_elapsed(drift_filter_time) < CAPSENSE_DRIFT_FILTER_PERIOD_MS) return;
+    drift_filter_time = timer_read();
+    for (i = 0; i < drift_ref_count; i++) {
+        drift_ref_t *ref = &drift_refs[i];
+        ref->filtered += ref->track.dac - (ref->filtered >> CAPSENSE_DRIFT_FILTER_SHIFT);
+        sum += (int16_t)(ref->filtered >> CAPSENSE_DRIFT_FILTER_SHIFT) - (int16_t)ref->baseline;
+    }
+    int16_t delta = sum / (int16_t)drift_ref_count - capsense_cal_drift;
+    if (!delta) return;
+    capsense_cal_drift += delta;
+    for (i = 0; i < CAPSENSE_CAL_BINS; i++) {
+        cal_thresholds[i] = dac_shift(cal_thresholds[i], delta);
+#    if CAPSENSE_CAL_HYSTERESIS
+        cal_release_thresholds[i] = dac_shift(cal_release_thresholds[i], delta);
+#    endif
+    }
+#    if CAPSENSE_SUSPEND_SCAN
+    suspend_threshold = dac_shift(suspend_threshold, delta);
+#    endif
+#    if CAPSENSE_RAPID_TRIGGER
+    for (i = 0; i < rapid_key_count; i++) {
+        rapid_keys[i].rest = RAPID_LEVEL(dac_shift(RAPID_LEVEL(rapid_keys[i].rest), delta));
+    }
+#    endif
+}
+#endif
+
+void calibration(void) {
+    uint16_t cal_thresholds_max[CAPSENSE_CAL_BINS];
+    uint16_t cal_thresholds_min[CAPSENSE_CAL_BINS];
+    uint8_t  key_bin[MATRIX_CAPSENSE_ROWS][MATRIX_COLS];
+#if CAPSENSE_SCAN_VOTING
+    int8_t   key_offset[MATRIX_CAPSENSE_ROWS][MATRIX_COLS]; // level of each key, relative to cal_thresholds[bin] below
+    uint16_t bin_center[CAPSENSE_CAL_BINS];
+#endif
+    memset(cal_thresholds_max, 0xff, sizeof(cal_thresholds_max));
+    memset(cal_thresholds_min, 0xff, sizeof(cal_thresholds_min));
+    memset(key_bin, 0xff, sizeof(key_bin));
+#ifdef NO_PRINT
+    uint16_t cal_tr_allzero;
+    uint16_t cal_tr_allone;
+#endif
+    cal_tr_allzero = calibration_measure_all_valid_keys(SCAN_SAMPLE_TIME, CAPSENSE_CAL_INIT_REPS, true);
+    cal_tr_allone  = calibration_measure_all_valid_keys(SCAN_SAMPLE_TIME, CAPSENSE_CAL_INIT_REPS, false);
+    uint16_t max   = (cal_tr_allzero == 0) ? 0 : (cal_tr_allzero - 1);
+    uint16_t min   = cal_tr_allone + 1;
+#if CAPSENSE_SUSPEND_SCAN
+#    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS
+    suspend_threshold = (cal_tr_allzero + CAPSENSE_CAL_THRESHOLD_OFFSET > CAPSENSE_DAC_MAX) ? CAPSENSE_DAC_MAX : cal_tr_allzero + CAPSENSE_CAL_THRESHOLD_OFFSET;
+#    else
+    suspend_threshold = (cal_tr_allone < CAPSENSE_CAL_THRESHOLD_OFFSET) ? 0 : cal_tr_allone - CAPSENSE_CAL_THRESHOLD_OFFSET;
+#    endif
+#endif
+    if (max < min) max = min;
+    uint16_t d = max - min;
+    uint8_t  i;
+#if CAPSENSE_CAL_TIME_DOMAIN
+    memset(cal_thresholds, 0, sizeof(cal_thresholds));
+    for (i = 0; i < CAPSENSE_CAL_TIME_DOMAIN_LEVELS; i++) {
+        cal_thresholds[i] = min + (d * (2 * i + 1)) / 2 / CAPSENSE_CAL_TIME_DOMAIN_LEVELS;
+    }
+    calibration_time_domain(key_bin);
+#else
+    for (i = 0; i < CAPSENSE_CAL_BINS; i++) {
+        cal_thresholds[i] = min + (d * (2 * i + 1)) / 2 / CAPSENSE_CAL_BINS;
     }
     uint8_t col;
     for (col = 0; col < MATRIX_COLS; col++) {
@@ -548,7 +1727,7 @@ void calibration(void) {
         uint8_t row;
         for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
             if (pgm_read_word(&keymaps[0][row][col]) != KC_NO) {
-                uint16_t threshold = measure_middle(physical_col, CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row), CAPSENSE_HARDCODED_SAMPLE_TIME, CAPSENSE_CAL_EACHKEY_REPS);
+                uint16_t threshold = measure_middle(physical_col, CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row), SCAN_SAMPLE_TIME, CAPSENSE_CAL_EACHKEY_REPS);
                 uint8_t  besti     = 0;
                 uint16_t best_diff = (uint16_t)abs(threshold - cal_thresholds[besti]);
                 for (i = 1; i < CAPSENSE_CAL_BINS; i++) {
@@ -558,14 +1737,22 @@ void calibration(void) {
                         besti     = i;
                     }
                 }
-                assigned_to_threshold[besti][row] |= (((matrix_row_t)1) << col);
+                key_bin[row][col] = besti;
+#if CAPSENSE_SCAN_VOTING
+                int16_t offset       = (int16_t)threshold - (int16_t)cal_thresholds[besti];
+                key_offset[row][col] = (offset > INT8_MAX) ? INT8_MAX : (offset < INT8_MIN) ? INT8_MIN : offset;
+#endif
                 if ((cal_thresholds_max[besti] == 0xFFFFU) || (cal_thresholds_max[besti] < threshold)) cal_thresholds_max[besti] = threshold;
                 if ((cal_thresholds_min[besti] == 0xFFFFU) || (cal_thresholds_min[besti] > threshold)) cal_thresholds_min[besti] = threshold;
             }
         }
     }
+#endif
     for (i = 0; i < CAPSENSE_CAL_BINS; i++) {
         uint16_t bin_signal_level;
+#if CAPSENSE_SCAN_VOTING
+        bin_center[i] = cal_thresholds[i];
+#endif
         if ((cal_thresholds_max[i] == 0xFFFFU) || (cal_thresholds_min[i] == 0xFFFFU)) {
             bin_signal_level = cal_thresholds[i];
         } else {
@@ -584,7 +1771,42 @@ void calibration(void) {
             cal_thresholds[i] = bin_signal_level - CAPSENSE_CAL_THRESHOLD_OFFSET;
         }
 #endif
+#if CAPSENSE_CAL_HYSTERESIS
+        // Split the threshold into press and release thresholds, centred on it.
+        uint16_t low  = (cal_thresholds[i] < CAPSENSE_CAL_HYSTERESIS_BAND / 2) ? 0 : cal_thresholds[i] - CAPSENSE_CAL_HYSTERESIS_BAND / 2;
+        uint16_t high = (cal_thresholds[i] + CAPSENSE_CAL_HYSTERESIS_BAND / 2 > CAPSENSE_DAC_MAX) ? CAPSENSE_DAC_MAX : cal_thresholds[i] + CAPSENSE_CAL_HYSTERESIS_BAND / 2;
+#    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS
+        cal_thresholds[i]         = high;
+        cal_release_thresholds[i] = low;
+#    else
+        cal_thresholds[i]         = low;
+        cal_release_thresholds[i] = high;
+#    endif
+#endif
+    }
+#if CAPSENSE_SCAN_VOTING
+    memset(scan_marginal_cols, 0, sizeof(scan_marginal_cols));
+    capsense_marginal_keys = 0;
+    for (col = 0; col < MATRIX_COLS; col++) {
+        uint8_t row;
+        for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
+            uint8_t bin = key_bin[row][col];
+            if (bin == 0xff) continue;
+            int16_t level = (int16_t)bin_center[bin] + key_offset[row][col];
+            if (abs((int16_t)cal_thresholds[bin] - level) < CAPSENSE_SCAN_VOTING_MARGIN) {
+                scan_marginal_cols[col] |= 1 << CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row);
+                capsense_marginal_keys++;
+            }
+        }
     }
+#endif
+    scan_schedule_build(key_bin);
+#if CAPSENSE_RAPID_TRIGGER
+    rapid_keys_calibrate();
+#endif
+#if CAPSENSE_DRIFT_COMPENSATION
+    drift_calibrate();
+#endif
 }
 
 void set_leds(int num_lock, int caps_lock, int scroll_lock) {
@@ -635,29 +1857,158 @@ layer_state_t layer_state_set_kb(layer_state_t state) {
 
 #if MATRIX_EXTRA_DIRECT_ROWS
 static pin_t extra_direct_pins[MATRIX_EXTRA_DIRECT_ROWS][MATRIX_COLS] = MATRIX_EXTRA_DIRECT_PINS;
-#endif
 
-#if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
-uint16_t cal_time;
-#endif
+// The direct pins are read a whole port at a time, with one IN instruction per port, and only the
+// bits that changed since the last read are scattered into the scan state, through a table that is
+// built from extra_direct_pins at init time. That's cheap enough to do along with every capsense
+// column, so direct-wired keys don't add a tail to the scan pass. Ports without direct keys are
+// skipped.
+// The direct keys are mechanical switches, and are debounced per key here: a press is committed at
+// once, and a release only once the key has read as released for MATRIX_EXTRA_DIRECT_DEBOUNCE_MS, so
+// a bounce back cancels it. QMK's DEBOUNCE may be 0 with some of the capsense scan options.
+enum {
+#    ifdef PINA
+    DIRECT_PORT_A,
+#    endif
+#    ifdef PINB
+    DIRECT_PORT_B,
+#    endif
+#    ifdef PINC
+    DIRECT_PORT_C,
+#    endif
+#    ifdef PIND
+    DIRECT_PORT_D,
+#    endif
+#    ifdef PINE
+    DIRECT_PORT_E,
+#    endif
+#    ifdef PINF
+    DIRECT_PORT_F,
+#    endif
+    DIRECT_PORTS
+};
 
-void real_keyboard_init_basic(void) {
-    SETUP_UNUSED_PINS();
+_Static_assert(MATRIX_EXTRA_DIRECT_ROWS * MATRIX_COLS < 0xff, "direct_port_keys can't address every direct key");
 
-#if defined(LED_NUM_LOCK_PIN)
-    setPinOutput(LED_NUM_LOCK_PIN);
-#endif
-#if defined(LED_CAPS_LOCK_PIN)
-    setPinOutput(LED_CAPS_LOCK_PIN);
-#endif
-#if defined(LED_SCROLL_LOCK_PIN)
-    setPinOutput(LED_SCROLL_LOCK_PIN);
-#endif
-#if defined(LED_NON_BASE_LAYER_PIN)
-    setPinOutput(LED_NON_BASE_LAYER_PIN);
-    set_led_non_base_layer(0);
-#endif
-    set_leds(0, 0, 0);
+static uint8_t direct_port_mask[DIRECT_PORTS];
+static uint8_t direct_port_state[DIRECT_PORTS];   // committed value, with active keys as 1
+static uint8_t direct_port_pending[DIRECT_PORTS]; // releases being debounced
+static uint8_t direct_port_keys[DIRECT_PORTS][8]; // row * MATRIX_COLS + col of each bit, or 0xff
+static uint8_t direct_key_since[MATRIX_EXTRA_DIRECT_ROWS * MATRIX_COLS]; // low byte of timer_read() at the start of a pending release
+
+static uint8_t direct_port_of(pin_t pin) {
+#    ifdef PINA
+    if (&PINx_ADDRESS(pin) == &PINA) return DIRECT_PORT_A;
+#    endif
+#    ifdef PINB
+    if (&PINx_ADDRESS(pin) == &PINB) return DIRECT_PORT_B;
+#    endif
+#    ifdef PINC
+    if (&PINx_ADDRESS(pin) == &PINC) return DIRECT_PORT_C;
+#    endif
+#    ifdef PIND
+    if (&PINx_ADDRESS(pin) == &PIND) return DIRECT_PORT_D;
+#    endif
+#    ifdef PINE
+    if (&PINx_ADDRESS(pin) == &PINE) return DIRECT_PORT_E;
+#    endif
+#    ifdef PINF
+    if (&PINx_ADDRESS(pin) == &PINF) return DIRECT_PORT_F;
+#    endif
+    return DIRECT_PORTS;
+}
+
+static void direct_ports_init(void) {
+    uint8_t row, col;
+    memset(direct_port_keys, 0xff, sizeof(direct_port_keys));
+    for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+        for (col = 0; col < MATRIX_EXTRA_DIRECT_COLS; col++) {
+            pin_t pin = extra_direct_pins[row][col];
+            if (pin == NO_PIN) continue;
+            uint8_t port = direct_port_of(pin);
+            if (port == DIRECT_PORTS) continue;
+            direct_port_mask[port] |= _BV(pin & 0xF);
+            direct_port_keys[port][pin & 0xF] = row * MATRIX_COLS + col;
+        }
+    }
+}
+
+static inline void direct_port_scatter(uint8_t port, uint8_t value) {
+#    if MATRIX_EXTRA_DIRECT_PINS_ACTIVE_LOW
+    value = ~value;
+#    endif
+    uint8_t changed = (value ^ direct_port_state[port]) & direct_port_mask[port];
+    direct_port_pending[port] &= changed;
+    if (!changed) return;
+    uint8_t now = timer_read();
+    uint8_t bit;
+    for (bit = 0; bit < 8; bit++) {
+        uint8_t mask = 1 << bit;
+        if (!(changed & mask)) continue;
+        uint8_t key = direct_port_keys[port][bit];
+        if (!(value & mask)) {
+            if (!(direct_port_pending[port] & mask)) {
+                direct_port_pending[port] |= mask;
+                direct_key_since[key] = now;
+                continue;
+            }
+            if ((uint8_t)(now - direct_key_since[key]) < MATRIX_EXTRA_DIRECT_DEBOUNCE_MS) continue;
+            direct_port_pending[port] &= ~mask;
+        }
+        direct_port_state[port] ^= mask;
+        scan_state.direct_rows[key / MATRIX_COLS] ^= ((matrix_row_t)1) << (key % MATRIX_COLS);
+        scan_dirty_cols |= ((matrix_row_t)1) << (key % MATRIX_COLS);
+#    if CAPSENSE_EVENT_QUEUE
+        scan_event_push(MATRIX_CAPSENSE_ROWS + key / MATRIX_COLS, key % MATRIX_COLS, value & mask);
+#    endif
+    }
+}
+#endif
+
+static inline void scan_direct_rows(void) {
+#if MATRIX_EXTRA_DIRECT_ROWS
+#    ifdef PINA
+    if (direct_port_mask[DIRECT_PORT_A]) direct_port_scatter(DIRECT_PORT_A, PINA);
+#    endif
+#    ifdef PINB
+    if (direct_port_mask[DIRECT_PORT_B]) direct_port_scatter(DIRECT_PORT_B, PINB);
+#    endif
+#    ifdef PINC
+    if (direct_port_mask[DIRECT_PORT_C]) direct_port_scatter(DIRECT_PORT_C, PINC);
+#    endif
+#    ifdef PIND
+    if (direct_port_mask[DIRECT_PORT_D]) direct_port_scatter(DIRECT_PORT_D, PIND);
+#    endif
+#    ifdef PINE
+    if (direct_port_mask[DIRECT_PORT_E]) direct_port_scatter(DIRECT_PORT_E, PINE);
+#    endif
+#    ifdef PINF
+    if (direct_port_mask[DIRECT_PORT_F]) direct_port_scatter(DIRECT_PORT_F, PINF);
+#    endif
+#endif
+}
+
+#if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
+uint16_t cal_time;
+#endif
+
+void real_keyboard_init_basic(void) {
+    SETUP_UNUSED_PINS();
+
+#if defined(LED_NUM_LOCK_PIN)
+    setPinOutput(LED_NUM_LOCK_PIN);
+#endif
+#if defined(LED_CAPS_LOCK_PIN)
+    setPinOutput(LED_CAPS_LOCK_PIN);
+#endif
+#if defined(LED_SCROLL_LOCK_PIN)
+    setPinOutput(LED_SCROLL_LOCK_PIN);
+#endif
+#if defined(LED_NON_BASE_LAYER_PIN)
+    setPinOutput(LED_NON_BASE_LAYER_PIN);
+    set_led_non_base_layer(0);
+#endif
+    set_leds(0, 0, 0);
 
 #ifndef NO_PRINT
     uprintf("shift_init()");
@@ -672,6 +2023,15 @@ void real_keyboard_init_basic(void) {
     uprintf(" DONE\n");
 #endif
     SETUP_ROW_GPIOS();
+#if defined(CAPSENSE_READ_ROWS_DECODE_NIBBLE_TABLES) && CAPSENSE_CAL_DEBUG
+    decode_tables_self_check();
+#endif
+#if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
+    scan_state_to_rows_self_check();
+#endif
+#ifdef SCAN_TIMER_ENABLED
+    scan_timer_init();
+#endif
 #if CAPSENSE_CAL_ENABLED
 #    if CAPSENSE_CAL_DEBUG
     cal_time = timer_read();
@@ -684,12 +2044,21 @@ void real_keyboard_init_basic(void) {
     dac_write_threshold(CAPSENSE_HARDCODED_THRESHOLD);
     dac_write_threshold(CAPSENSE_HARDCODED_THRESHOLD);
     dac_write_threshold(CAPSENSE_HARDCODED_THRESHOLD);
+    scan_schedule_build_uncalibrated();
 #endif
 #ifdef USING_SOLENOID_ENABLE_PIN
     // This must be defined in config.h if you are using and xwhatsit type solenoid
     setPinOutput(USING_SOLENOID_ENABLE_PIN);
     writePin(USING_SOLENOID_ENABLE_PIN, 1);
 #endif
+#if CAPSENSE_SOLENOID
+    setPinOutput(CAPSENSE_SOLENOID_PIN);
+    writePin(CAPSENSE_SOLENOID_PIN, 0);
+#    ifdef HAPTIC_ENABLE_PIN
+    setPinOutput(HAPTIC_ENABLE_PIN);
+    writePin(HAPTIC_ENABLE_PIN, 1);
+#    endif
+#endif
 #if defined(CONTROLLER_IS_THROUGH_HOLE_BEAMSPRING) || defined(CONTROLLER_IS_THROUGH_HOLE_MODEL_F)
     // Disable on-board leds.
     setPinOutput(D5);
@@ -710,6 +2079,10 @@ void real_keyboard_init_basic(void) {
             }
         }
     }
+    direct_ports_init();
+#endif
+#if CAPSENSE_SETTLE_DIAGNOSTIC
+    settle_diagnostic();
 #endif
 }
 
@@ -721,22 +2094,46 @@ bool led_update_kb(led_t led_state) {
     return res;
 }
 
+#if CAPSENSE_SCAN_IN_ISR
+static void scan_isr_start(void);
+#endif
+
 void matrix_init_custom(void) {
     // test_v2();
     // tracking_test();
     real_keyboard_init_basic();
+#if CAPSENSE_SCAN_IN_ISR
+    scan_isr_start();
+#endif
 }
 
 matrix_row_t previous_matrix[MATRIX_ROWS];
+matrix_row_t matrix_dirty_cols; // columns that changed during the last matrix_scan_custom()
+static bool  matrix_resync;     // previous_matrix doesn't follow the scanner's matrix
 
 bool matrix_has_it_changed(const matrix_row_t current_matrix[]) {
     uint8_t row;
-    bool    changed = false;
+    matrix_dirty_cols = 0;
     for (row = 0; row < MATRIX_ROWS; row++) {
-        if (previous_matrix[row] != current_matrix[row]) changed = true;
+        matrix_dirty_cols |= previous_matrix[row] ^ current_matrix[row];
         previous_matrix[row] = current_matrix[row];
     }
-    return changed;
+    return matrix_dirty_cols != 0;
+}
+
+// Same as matrix_has_it_changed(), but only the columns in dirty_cols are taken from the scan state,
+// and the rest of the matrix is known to be unchanged.
+static bool matrix_merge_dirty_cols(matrix_row_t current_matrix[], const scan_state_t *state, matrix_row_t dirty_cols) {
+    if (matrix_resync) {
+        dirty_cols    = ~(matrix_row_t)0;
+        matrix_resync = false;
+    }
+    if (!dirty_cols) {
+        matrix_dirty_cols = 0;
+        return false;
+    }
+    scan_state_to_rows(state, current_matrix, dirty_cols);
+    return matrix_has_it_changed(current_matrix);
 }
 
 #if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
@@ -747,24 +2144,259 @@ bool cal_stats_printed = false;
 bool keyboard_scan_enabled = 1;
 #endif
 
+#if CAPSENSE_SCAN_SOF_SYNC
+// USB start-of-frame synchronization: the host polls the interrupt IN endpoint once per 1 ms frame, so
+// a report that becomes ready just after the poll waits for almost a whole frame. Instead of scanning
+// back to back, one scan is started per frame, timed so that the scan, the debounce, and the report
+// processing that follows are done CAPSENSE_SCAN_SOF_MARGIN_US before the next start-of-frame.
+// The frame number register is polled, because the SOF interrupt belongs to LUFA. Without SOFs (e.g.
+// before enumeration, or during suspend) this simply scans once per millisecond.
+#    define SOF_PERIOD_TICKS SCAN_TIMER_US_TO_TICKS(1000)
+#    define SOF_MARGIN_TICKS SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_SOF_MARGIN_US)
+
+uint16_t        capsense_sof_phase_us;         // start-of-frame to report ready, for the last report
+static uint16_t sof_time;                      // Timer1 timestamp of a start-of-frame
+static uint16_t sof_scan_start;                // Timer1 timestamp of the start of the current scan
+static uint16_t sof_lead = SOF_MARGIN_TICKS;   // scan start to report ready, plus the margin
+static bool     sof_outlier;                   // the last lead was discarded as an outlier
+static uint32_t sof_last_activity;
+#    if CAPSENSE_SCAN_STATS
+uint16_t        capsense_sof_phase_max_us; // worst start-of-frame to report ready during the last second
+static uint16_t sof_phase_max_us;
+#    endif
+
+// Waits until it's time to start the next scan.
+static void sof_sync_wait(void) {
+    uint16_t start_phase = SOF_PERIOD_TICKS - sof_lead % SOF_PERIOD_TICKS;
+    uint16_t now         = scan_timer_read();
+    uint16_t phase       = (uint16_t)(now - sof_time) % SOF_PERIOD_TICKS;
+    uint8_t  frame       = UDFNUML;
+    sof_time             = now - phase; // keep this recent, so that the timer comparisons never wrap
+    uint16_t start       = sof_time + start_phase;
+    if (phase >= start_phase) start += SOF_PERIOD_TICKS;
+    while ((int16_t)(scan_timer_read() - start) < 0) {
+        if (UDFNUML != frame) {
+            // Resynchronize on every start-of-frame seen while waiting, to follow the host's clock.
+            sof_time = scan_timer_read();
+            frame    = UDFNUML;
+            start    = sof_time + start_phase;
+        }
+    }
+    sof_scan_start = scan_timer_read();
+}
+
+// Runs after keyboard_task(), so any report caused by this scan has been handed to the endpoint.
+void housekeeping_task_kb(void) {
+    uint16_t now      = scan_timer_read();
+    uint16_t lead     = now - sof_scan_start + SOF_MARGIN_TICKS;
+    bool     reported = last_matrix_activity_time() != sof_last_activity;
+    // A single lead of more than twice the current one is an outlier, like printing to the console, but
+    // a second one in a row is real. Leads of a whole frame or more are clamped, so that scans that
+    // take that long still start just after a start-of-frame.
+    if (lead > 2 * sof_lead && !sof_outlier) {
+        sof_outlier = true;
+    } else {
+        sof_outlier = false;
+        if (lead >= SOF_PERIOD_TICKS) lead = SOF_PERIOD_TICKS - 1;
+        if (lead > sof_lead) {
+            sof_lead = lead;
+        } else if (reported) {
+            sof_lead -= (sof_lead - lead) >> 3;
+        }
+    }
+    if (reported) {
+        sof_last_activity     = last_matrix_activity_time();
+        capsense_sof_phase_us = SCAN_TIMER_TICKS_TO_US((uint16_t)(now - sof_time));
+#    if CAPSENSE_SCAN_STATS
+        if (capsense_sof_phase_us > sof_phase_max_us) sof_phase_max_us = capsense_sof_phase_us;
+#    endif
+    }
+}
+#endif
+
+#if CAPSENSE_SCAN_IDLE
+// Idle scanning: after CAPSENSE_SCAN_IDLE_TIMEOUT_MS without any change, and with no key held down,
+// only one pass is scanned every CAPSENSE_SCAN_IDLE_PERIOD_MS, and in between the MCU sleeps until
+// the next interrupt (at most until the next 1 ms timer tick), instead of bit-banging the DAC and the
+// shift register flat out. The first change goes back to full rate, so a press that wakes the scan is
+// reported at most CAPSENSE_SCAN_IDLE_PERIOD_MS plus one pass later than at full rate. (With
+// CAPSENSE_SCAN_HOT_KEYS, idle passes scan the whole schedule, and not just the next cold slice.)
+bool            capsense_scan_idle;
+static uint32_t idle_activity_time; // timer_read32() at the last change
+static uint16_t idle_pass_time;     // timer_read() at the start of the last idle pass
+
+static bool scan_state_any_key_down(void) {
+    uint8_t any = 0;
+    uint8_t col;
+    for (col = 0; col < MATRIX_COLS; col++) {
+        any |= scan_state.cols[col];
+    }
+#    if MATRIX_EXTRA_DIRECT_ROWS
+    uint8_t row;
+    for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+        if (scan_state.direct_rows[row]) return true;
+    }
+#    endif
+    return any != 0;
+}
+
+// Returns whether to scan now.
+static bool scan_idle_governor(void) {
+    if (!capsense_scan_idle) {
+        if (timer_elapsed32(idle_activity_time) < CAPSENSE_SCAN_IDLE_TIMEOUT_MS || scan_state_any_key_down()) {
+            return true;
+        }
+        capsense_scan_idle = true;
+    } else if (timer_elapsed(idle_pass_time) < CAPSENSE_SCAN_IDLE_PERIOD_MS) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_mode();
+        return false;
+    }
+    idle_pass_time = timer_read();
+    return true;
+}
+
+static void scan_idle_activity(void) {
+    idle_activity_time = timer_read32();
+    capsense_scan_idle = false;
+}
+#endif
+
+#if CAPSENSE_SCAN_STATS
+uint16_t        capsense_scan_rate; // complete capsense passes during the last second
+static uint16_t scan_rate_count;
+static uint16_t scan_rate_timer;
+#    if CAPSENSE_SCAN_HOT_KEYS
+uint16_t        capsense_cold_scan_rate; // complete scans of the keys that aren't hot during the last second
+static uint16_t cold_scan_rate_count;
+#    endif
+
+#    if CAPSENSE_SCAN_EAGER && !CAPSENSE_SCAN_IN_ISR
+uint16_t capsense_eager_mismatches; // full matrix checks that found a difference, since power-up
+#    endif
+#    if CAPSENSE_EVENT_QUEUE
+uint16_t        capsense_event_latency_max_ms; // longest time an event waited in the queue during the last second
+static uint16_t event_latency_max_ms;
+#    endif
+
+static bool     scan_stats_updated;
+
+static void scan_stats_pass_done(void) {
+    scan_rate_count++;
+    if (timer_elapsed(scan_rate_timer) >= 1000) {
+        scan_rate_timer    = timer_read();
+        capsense_scan_rate = scan_rate_count;
+        scan_rate_count    = 0;
+#    if CAPSENSE_SCAN_HOT_KEYS
+        capsense_cold_scan_rate = cold_scan_rate_count;
+        cold_scan_rate_count    = 0;
+#    endif
+#    if CAPSENSE_SCAN_SOF_SYNC
+        capsense_sof_phase_max_us = sof_phase_max_us;
+        sof_phase_max_us          = 0;
+#    endif
+#    if CAPSENSE_EVENT_QUEUE
+        capsense_event_latency_max_ms = event_latency_max_ms;
+        event_latency_max_ms          = 0;
+#    endif
+        scan_stats_updated = true;
+    }
+}
+#endif
+
+#if CAPSENSE_SCAN_HOT_KEYS
+static uint8_t scan_cold_slice;
+
+// Each pass scans the hot slots, and then the next slice of the other slots, in *first..*end.
+static void scan_next_cold_slice(uint8_t *first, uint8_t *end) {
+    uint8_t cold_count = scan_slot_count() - scan_hot_end;
+    *first             = scan_hot_end + (uint16_t)cold_count * scan_cold_slice / CAPSENSE_SCAN_COLD_SLICES;
+    *end               = scan_hot_end + (uint16_t)cold_count * (scan_cold_slice + 1) / CAPSENSE_SCAN_COLD_SLICES;
+    if (++scan_cold_slice == CAPSENSE_SCAN_COLD_SLICES) {
+        scan_cold_slice = 0;
+#    if CAPSENSE_SCAN_STATS
+        cold_scan_rate_count++;
+#    endif
+    }
+}
+#endif
+
+#if CAPSENSE_SETTLE_DIAGNOSTIC && !defined(NO_PRINT)
+static bool settle_diag_printed = false;
+#endif
+
 #ifndef NO_PRINT
 void matrix_print_stats(void) {
     uint8_t row, cal;
+#    if CAPSENSE_SETTLE_DIAGNOSTIC
+    if (!settle_diag_printed && timer_read32() >= 10 * 1000UL) { // after 10 seconds
+        static const char *const order_names[CAPSENSE_COL_ORDERS] = {"keymap", "interleaved", "farthest-first"};
+        uint8_t                  kind;
+        for (kind = 0; kind < CAPSENSE_COL_ORDERS; kind++) {
+            uprintf("Settle time, %s column order: %u us\n", order_names[kind], capsense_settle_min_us[kind]);
+        }
+        settle_diag_printed = true;
+    }
+#    endif
+#    if CAPSENSE_SCAN_STATS
+    if (scan_stats_updated) {
+        scan_stats_updated = false;
+#        if CAPSENSE_SCAN_HOT_KEYS
+        uprintf("Scan rate: %u/s hot keys, %u/s others\n", capsense_scan_rate, capsense_cold_scan_rate);
+#        else
+        uprintf("Scan rate: %u/s\n", capsense_scan_rate);
+#        endif
+#        if CAPSENSE_SCAN_SOF_SYNC
+        uprintf("SOF to report ready: %u us max\n", capsense_sof_phase_max_us);
+#        endif
+#        if CAPSENSE_SCAN_EAGER && !CAPSENSE_SCAN_IN_ISR
+        uprintf("Eager scan mismatches: %u\n", capsense_eager_mismatches);
+#        endif
+#        if CAPSENSE_SCAN_IDLE
+        uprintf("Idle scanning: %s\n", capsense_scan_idle ? "on" : "off");
+#        endif
+#        if CAPSENSE_EVENT_QUEUE
+        uprintf("Event queue: %u ms max latency, %u overflows\n", capsense_event_latency_max_ms, capsense_event_overflows);
+#        endif
+#        if CAPSENSE_SCAN_RESAMPLE
+        uprintf("Interference resamples: %u, over budget: %u\n", capsense_scan_resamples, capsense_scan_resample_drops);
+#        endif
+#        if CAPSENSE_DRIFT_COMPENSATION
+        uprintf("Threshold drift: %d\n", capsense_cal_drift);
+#        endif
+#        if CAPSENSE_SOLENOID
+        uprintf("Interfered samples: %lu of %lu with the solenoid off, %lu of %lu energized\n", capsense_solenoid_interfered[0], capsense_solenoid_samples[0], capsense_solenoid_interfered[1], capsense_solenoid_samples[1]);
+#        endif
+#        if CAPSENSE_SCAN_VOTING
+        uprintf("Marginal keys: %u, vote samples: %u, rejected: %u\n", capsense_marginal_keys, capsense_scan_votes, capsense_scan_vote_rejects);
+#        endif
+    }
+#    endif
 #    if CAPSENSE_CAL_ENABLED && CAPSENSE_CAL_DEBUG
     if (!cal_stats_printed) {
         uint32_t time = timer_read32();
         if (time >= 10 * 1000UL) { // after 10 seconds
             uprintf("Calibration took: %u ms\n", cal_time);
+#        ifdef CAPSENSE_READ_ROWS_DECODE_NIBBLE_TABLES
+            uprintf("Decode tables: %s\n", decode_tables_ok ? "OK" : "MISMATCH");
+#        endif
+            uprintf("Matrix transpose: %s\n", scan_state_to_rows_ok ? "OK" : "MISMATCH");
             uprintf("Cal All Zero = %u, Cal All Ones = %u\n", cal_tr_allzero, cal_tr_allone);
             for (cal = 0; cal < CAPSENSE_CAL_BINS; cal++) {
+                matrix_row_t assigned_to_threshold[MATRIX_CAPSENSE_ROWS];
+                get_assigned_to_threshold(cal, assigned_to_threshold);
+#        if CAPSENSE_CAL_HYSTERESIS
+                uprintf("Cal bin %u, Threshold=%u Release=%u Assignments:\n", cal, cal_thresholds[cal], cal_release_thresholds[cal]);
+#        else
                 uprintf("Cal bin %u, Threshold=%u Assignments:\n", cal, cal_thresholds[cal]);
+#        endif
                 for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
 #        if MATRIX_COLS > 16
-                    uprintf("0x%06X\n", assigned_to_threshold[cal][row]);
+                    uprintf("0x%06X\n", assigned_to_threshold[row]);
 #        elif MATRIX_COLS > 12
-                    uprintf("0x%04X\n", assigned_to_threshold[cal][row]);
+                    uprintf("0x%04X\n", assigned_to_threshold[row]);
 #        else
-                    uprintf("0x%03X\n", assigned_to_threshold[cal][row]);
+                    uprintf("0x%03X\n", assigned_to_threshold[row]);
 #        endif
                 }
             }
@@ -775,64 +2407,903 @@ void matrix_print_stats(void) {
 }
 #endif
 
-void matrix_scan_raw(matrix_row_t current_matrix[]) {
-    uint8_t col, row;
-    memset(current_matrix, 0, sizeof(matrix_row_t) * MATRIX_ROWS);
-#if CAPSENSE_CAL_ENABLED
-    uint8_t cal;
-    for (cal = 0; cal < CAPSENSE_CAL_BINS; cal++) {
-        dac_write_threshold(cal_thresholds[cal]);
-        for (col = 0; col < MATRIX_COLS; col++) {
-            uint8_t real_col = CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col);
-            uint8_t d, interference;
-            uint8_t d_tested = 0;
-            for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
-                if (assigned_to_threshold[cal][row] & (((matrix_row_t)1) << col)) {
-                    if (!d_tested) {
-                        d = test_single(real_col, CAPSENSE_HARDCODED_SAMPLE_TIME, &interference);
+#if CAPSENSE_SOLENOID
+// Scan-synchronized solenoid: a debounced key press requests a pulse (process_record_kb() in
+// beamspring.c), but the solenoid pin only changes between passes (or between two slots, when
+// scanning in the ISR), followed by CAPSENSE_SOLENOID_SETTLE_US for the rows to recover from the
+// current step, so that no sample is ever taken across an edge.
+// The pulse ends at the first pass boundary after CAPSENSE_SOLENOID_DWELL_MS. The samples, and the
+// ones with interference on any of their keys, are counted separately for while the solenoid is
+// energized and while it's off.
+bool                 capsense_solenoid_enabled = true;
+uint32_t             capsense_solenoid_samples[2];    // [energized], since power-up
+uint32_t             capsense_solenoid_interfered[2]; // [energized], since power-up
+static volatile bool solenoid_requested;
+static bool          solenoid_on;
+static bool          solenoid_suspended;
+static uint16_t      solenoid_on_time;
+
+void capsense_solenoid_fire(void) {
+    if (capsense_solenoid_enabled && !solenoid_suspended) solenoid_requested = true;
+}
+
+static void solenoid_off(void) {
+    solenoid_on        = false;
+    solenoid_requested = false;
+    writePin(CAPSENSE_SOLENOID_PIN, 0);
+}
+
+// USB suspend: any pulse is cut short, and with HAPTIC_OFF_IN_LOW_POWER, the current limiter of
+// xwhatsit's solenoid board is disabled until wake up.
+static void solenoid_suspend(void) {
+    solenoid_suspended = true;
+    solenoid_off();
+#    if defined(HAPTIC_ENABLE_PIN) && HAPTIC_OFF_IN_LOW_POWER
+    writePin(HAPTIC_ENABLE_PIN, 0);
+#    endif
+}
+
+static void solenoid_wakeup(void) {
+#    if defined(HAPTIC_ENABLE_PIN) && HAPTIC_OFF_IN_LOW_POWER
+    writePin(HAPTIC_ENABLE_PIN, 1);
+#    endif
+    solenoid_suspended = false;
+}
+
+// Starts or ends a pulse; only called between samples. Returns whether the pin changed, in which case
+// the caller lets the rows settle before the next sample.
+static bool solenoid_service(void) {
+    if (solenoid_on) {
+        if (timer_elapsed(solenoid_on_time) < CAPSENSE_SOLENOID_DWELL_MS) return false;
+        solenoid_off();
+        return true;
+    }
+    if (!solenoid_requested) return false;
+    solenoid_requested = false;
+    solenoid_on        = true;
+    solenoid_on_time   = timer_read();
+    writePin(CAPSENSE_SOLENOID_PIN, 1);
+    return true;
+}
+
+static inline void solenoid_count_sample(uint8_t interference) {
+    capsense_solenoid_samples[solenoid_on]++;
+    if (interference) capsense_solenoid_interfered[solenoid_on]++;
+}
+#endif
+
+static inline void scan_apply(uint8_t col, uint8_t changed) {
+    scan_state.cols[col] ^= changed;
+    scan_dirty_cols |= ((matrix_row_t)1) << col;
+#if CAPSENSE_EVENT_QUEUE
+    uint8_t physical_row;
+    for (physical_row = 0; physical_row < MATRIX_CAPSENSE_ROWS; physical_row++) {
+        if (changed & (1 << physical_row)) {
+            scan_event_push(CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(physical_row), col, scan_state.cols[col] & (1 << physical_row));
+        }
+    }
+#endif
+}
+
+#if CAPSENSE_KEY_DEBOUNCE
+// Per-key debounce, with the interference bits as a confidence signal. A clean sample commits a press
+// immediately, but a release is only committed once the key has read as released for
+// CAPSENSE_KEY_DEBOUNCE_RELEASE_MS. An interfered sample never changes a key, and restarts the
+// release window of a key that is being released.
+static uint8_t scan_release_pending[MATRIX_COLS];
+static uint8_t scan_release_since[MATRIX_COLS][MATRIX_CAPSENSE_ROWS]; // low byte of timer_read()
+
+static inline uint8_t scan_debounce_press(uint8_t col, uint8_t d, uint8_t interference) {
+    return d & ~scan_state.cols[col] & ~interference;
+}
+
+// d is the sample of the keys in rows; returns the keys whose release is committed.
+static uint8_t scan_debounce_release(uint8_t col, uint8_t rows, uint8_t d, uint8_t interference) {
+    uint8_t pressed = scan_state.cols[col] & rows;
+    uint8_t pending = scan_release_pending[col] & ~(pressed & d & ~interference);
+    uint8_t check   = (pressed & ~d & ~interference) | (pending & rows);
+    if (!check) {
+        scan_release_pending[col] = pending;
+        return 0;
+    }
+    uint8_t now      = (uint8_t)timer_read();
+    uint8_t released = 0;
+    uint8_t physical_row;
+    for (physical_row = 0; physical_row < MATRIX_CAPSENSE_ROWS; physical_row++) {
+        uint8_t bit = 1 << physical_row;
+        if (!(check & bit)) continue;
+        if (!(pending & bit)) {
+            pending |= bit;
+            scan_release_since[col][physical_row] = now;
+        } else if (interference & bit) {
+            scan_release_since[col][physical_row] = now;
+        } else if ((uint8_t)(now - scan_release_since[col][physical_row]) >= CAPSENSE_KEY_DEBOUNCE_RELEASE_MS) {
+            pending &= ~bit;
+            released |= bit;
+        }
+    }
+    scan_release_pending[col] = pending;
+    return released;
+}
+#endif
+
+#if CAPSENSE_SCAN_RESAMPLE
+// Slots whose sample had an interference bit set, in scan order. They are sampled again right after
+// the range that's being scanned, and a retry that's interfered again is queued again, so the length
+// of the list is also the retry budget of a pass.
+static uint8_t scan_resample_slots[CAPSENSE_SCAN_RESAMPLE_BUDGET];
+static uint8_t scan_resample_count; // queued during this pass
+static uint8_t scan_resample_next;  // next one to sample again
+uint16_t       capsense_scan_resamples;      // since power-up
+uint16_t       capsense_scan_resample_drops; // interfered samples that didn't fit in the budget, since power-up
+
+static inline void scan_resample_queue(uint8_t slot) {
+    if (scan_resample_count < CAPSENSE_SCAN_RESAMPLE_BUDGET) {
+        scan_resample_slots[scan_resample_count++] = slot;
+    } else {
+        capsense_scan_resample_drops++;
+    }
+}
+#endif
+
+#if CAPSENSE_SCAN_VOTING
+// Transitions of marginal keys aren't applied straight away: their slot is queued, and after the range
+// that's being scanned, sampled up to CAPSENSE_SCAN_VOTING_SAMPLES - 1 more times, stopping as soon as
+// the majority is certain for each of the keys. Transitions that lose the vote are dropped, and if the
+// queue is full, left for the next pass.
+#    define SCAN_VOTE_QUEUE 8
+
+typedef struct {
+    uint8_t slot;
+    uint8_t rows; // physical rows with a pending transition
+} scan_vote_t;
+
+static scan_vote_t scan_votes[SCAN_VOTE_QUEUE];
+static uint8_t     scan_vote_count;
+uint16_t           capsense_scan_votes;        // samples taken for votes, since power-up
+uint16_t           capsense_scan_vote_rejects; // transitions that lost the vote, since power-up
+
+// Queues the transitions of marginal keys, and returns the ones that can be applied.
+static inline uint8_t scan_vote_defer(uint8_t slot, uint8_t changed) {
+    uint8_t marginal = changed & scan_marginal_cols[scan_slots[slot].col];
+    if (!marginal) return changed;
+    uint8_t i;
+    for (i = 0; i < scan_vote_count; i++) {
+        if (scan_votes[i].slot == slot) break;
+    }
+    if (i == scan_vote_count) {
+        if (i == SCAN_VOTE_QUEUE) return changed & ~marginal;
+        scan_votes[i].slot = slot;
+        scan_votes[i].rows = 0;
+        scan_vote_count++;
+    }
+    scan_votes[i].rows |= marginal;
+    return changed & ~marginal;
+}
+#endif
+
+static inline void scan_decode(uint8_t slot, uint8_t d, uint8_t interference) {
+    scan_direct_rows();
+#ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS
+    d = ~d;
+#endif
+    uint8_t col = scan_slots[slot].col;
+    d &= scan_slots[slot].rows;
+#if CAPSENSE_SOLENOID
+    solenoid_count_sample(interference & scan_slots[slot].rows);
+#endif
+#if CAPSENSE_SCAN_RESAMPLE
+    if (interference & scan_slots[slot].rows) scan_resample_queue(slot);
+#endif
+#if CAPSENSE_KEY_DEBOUNCE
+#    if !CAPSENSE_CAL_ENABLED
+    interference = 0;
+#    endif
+    uint8_t changed = scan_debounce_press(col, d, interference);
+#    if !CAPSENSE_CAL_HYSTERESIS
+    changed |= scan_debounce_release(col, scan_slots[slot].rows, d, interference);
+#    endif
+#else
+#    if CAPSENSE_CAL_ENABLED
+    d &= ~interference;
+#    endif
+#    if CAPSENSE_CAL_HYSTERESIS
+    // Sampled at the press threshold: keys that are already pressed wait for the release threshold.
+    d |= scan_state.cols[col] & scan_slots[slot].rows;
+#    endif
+    uint8_t changed = (scan_state.cols[col] & scan_slots[slot].rows) ^ d;
+#endif
+#if CAPSENSE_SCAN_VOTING
+    changed = scan_vote_defer(slot, changed);
+#endif
+    if (!changed) return;
+    scan_apply(col, changed);
+}
+
+#if !CAPSENSE_SCAN_IN_ISR
+// Samples a single slot outside of the schedule runner, with the DAC already set for its bin.
+static uint8_t scan_sample_slot(uint8_t slot, uint8_t *interference_ptr) {
+    uint8_t physical_col = CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot].col);
+#    if CAPSENSE_CAL_TIME_DOMAIN
+    scan_capture_col(physical_col);
+    *interference_ptr = window_value(scan_window, 0);
+    return window_value(scan_window, scan_slots[slot].time + 1);
+#    else
+    return scan_sample_col(physical_col, interference_ptr);
+#    endif
+}
+#endif
+
+#if CAPSENSE_SCAN_RESAMPLE
+// Samples the queued slots again, each at the threshold of its bin.
+static void scan_resample_run(void) {
+    uint8_t bin = 0xff;
+    while (scan_resample_next < scan_resample_count) {
+        uint8_t slot     = scan_resample_slots[scan_resample_next++];
+        uint8_t slot_bin = scan_bin_of_slot(slot);
+        if (slot_bin != bin) {
+            if (bin != 0xff) scan_pass_end();
+            bin = slot_bin;
+            dac_write_threshold(cal_thresholds[scan_bins[bin].cal_bin]);
+            scan_pass_begin();
+        }
+        uint8_t interference;
+        uint8_t d = scan_sample_slot(slot, &interference);
+        capsense_scan_resamples++;
+        scan_decode(slot, d, interference);
+    }
+    if (bin != 0xff) scan_pass_end();
+}
+#endif
+
+#if CAPSENSE_SCAN_VOTING
+// Votes on the queued transitions. The sample that saw the transition counts as the first vote for it,
+// and interfered samples don't vote.
+static void scan_vote_run(void) {
+    uint8_t bin = 0xff;
+    uint8_t i;
+    for (i = 0; i < scan_vote_count; i++) {
+        uint8_t slot     = scan_votes[i].slot;
+        uint8_t col      = scan_slots[slot].col;
+        uint8_t pending  = scan_votes[i].rows;
+        uint8_t slot_bin = scan_bin_of_slot(slot);
+        uint8_t votes_for[MATRIX_CAPSENSE_ROWS];
+        uint8_t votes_against[MATRIX_CAPSENSE_ROWS];
+        uint8_t confirmed = 0;
+        uint8_t n, physical_row;
+        if (slot_bin != bin) {
+            if (bin != 0xff) scan_pass_end();
+            bin = slot_bin;
+            dac_write_threshold(cal_thresholds[scan_bins[bin].cal_bin]);
+            scan_pass_begin();
+        }
+        memset(votes_for, 1, sizeof(votes_for));
+        memset(votes_against, 0, sizeof(votes_against));
+        for (n = 1; pending && (n < CAPSENSE_SCAN_VOTING_SAMPLES); n++) {
+            uint8_t interference;
+            uint8_t d = scan_sample_slot(slot, &interference);
+            capsense_scan_votes++;
 #    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS
-                        d = ~d;
+            d = ~d;
 #    endif
-                        d_tested = 1;
-                    }
-                    uint8_t physical_row = CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row);
-                    if (!((interference >> physical_row) & 1)) {
-                        current_matrix[row] |= ((matrix_row_t)((d >> physical_row) & 1)) << col;
+            uint8_t changed = d ^ scan_state.cols[col];
+            for (physical_row = 0; physical_row < MATRIX_CAPSENSE_ROWS; physical_row++) {
+                uint8_t bit = 1 << physical_row;
+                if (!(pending & bit) || (interference & bit)) continue;
+                if (changed & bit) {
+                    if (++votes_for[physical_row] > CAPSENSE_SCAN_VOTING_SAMPLES / 2) {
+                        confirmed |= bit;
+                        pending &= ~bit;
                     }
+                } else if (++votes_against[physical_row] > CAPSENSE_SCAN_VOTING_SAMPLES / 2) {
+                    pending &= ~bit;
+                    capsense_scan_vote_rejects++;
                 }
             }
         }
+        if (confirmed) scan_apply(col, confirmed);
+    }
+    scan_vote_count = 0;
+    if (bin != 0xff) scan_pass_end();
+}
+#endif
+
+#if CAPSENSE_RAPID_TRIGGER
+static uint16_t rapid_follow_time; // timer_read() at the last follow step
+
+// Tracks each rapid trigger key with a few level tracker steps, and applies its transitions. Every
+// CAPSENSE_RAPID_TRIGGER_FOLLOW_MS, the lowest level of a released key (and its level at rest, unless
+// drift compensation already shifts it) moves one DAC unit towards the current level, so that slow
+// drift can't add up to a press.
+static void rapid_keys_scan(void) {
+    uint8_t i, n;
+    bool    follow = timer_elapsed(rapid_follow_time) >= CAPSENSE_RAPID_TRIGGER_FOLLOW_MS;
+    if (follow) rapid_follow_time = timer_read();
+    for (i = 0; i < rapid_key_count; i++) {
+        rapid_key_t *key          = &rapid_keys[i];
+        uint8_t      physical_col = CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(key->col);
+        for (n = 0; n < CAPSENSE_RAPID_TRIGGER_STEPS; n++) {
+            level_tracker_step(&key->track, physical_col, key->row_mask);
+        }
+        uint16_t level   = RAPID_LEVEL(key->track.dac);
+        bool     pressed = scan_state.cols[key->col] & key->row_mask;
+        if (!pressed) {
+            if (level < key->extreme) key->extreme = level;
+            if (follow) {
+                if (level > key->extreme) key->extreme++;
+#    if !CAPSENSE_DRIFT_COMPENSATION
+                if (level > key->rest) {
+                    key->rest++;
+                } else if (level < key->rest) {
+                    key->rest--;
+                }
+#    endif
+            }
+            if ((level >= key->extreme + CAPSENSE_RAPID_TRIGGER_DELTA) && (level >= key->rest + CAPSENSE_RAPID_TRIGGER_DELTA)) {
+                key->extreme = level;
+                scan_apply(key->col, key->row_mask);
+            }
+        } else {
+            if (level > key->extreme) key->extreme = level;
+            if ((level + CAPSENSE_RAPID_TRIGGER_DELTA <= key->extreme) || (level <= key->rest + CAPSENSE_RAPID_TRIGGER_DELTA / 2)) {
+                key->extreme = level;
+                scan_apply(key->col, key->row_mask);
+            }
+        }
     }
+}
+#endif
+
+#if CAPSENSE_CAL_HYSTERESIS
+// Sampled at the release threshold: only pressed keys can change, and not on an interfered sample.
+static inline void scan_decode_release(uint8_t slot, uint8_t d, uint8_t interference) {
+#    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS
+    d = ~d;
+#    endif
+    uint8_t col = scan_slots[slot].col;
+#    if CAPSENSE_KEY_DEBOUNCE
+    uint8_t released = scan_debounce_release(col, scan_slots[slot].rows, d, interference);
+#    else
+    uint8_t released = scan_state.cols[col] & scan_slots[slot].rows & ~d & ~interference;
+#    endif
+    if (!released) return;
+    scan_apply(col, released);
+}
+
+// Samples the slots in slot..end that have keys pressed again, at the release threshold of their bin.
+// Usually only a few keys are pressed, so this costs much less than a second pass.
+static void scan_release_run(uint8_t slot, uint8_t end) {
+    if (slot >= end) return;
+    uint8_t bin = scan_bin_of_slot(slot);
+    for (; slot < end; bin++) {
+        uint8_t bin_end     = (scan_bins[bin].end < end) ? scan_bins[bin].end : end;
+        bool    dac_written = false;
+        for (; slot < bin_end; slot++) {
+            if (!(scan_state.cols[scan_slots[slot].col] & scan_slots[slot].rows)) continue;
+            if (!dac_written) {
+                dac_write_threshold(cal_release_thresholds[scan_bins[bin].cal_bin]);
+                scan_pass_begin();
+                dac_written = true;
+            }
+            uint8_t interference;
+            uint8_t d = scan_sample_slot(slot, &interference);
+            scan_decode_release(slot, d, interference);
+        }
+        if (dac_written) scan_pass_end();
+    }
+}
+#endif
+
+#if CAPSENSE_SCAN_IN_ISR
+// The scan loop is replaced by scan_isr_step()
+#elif CAPSENSE_SCAN_PIPELINED
+// Pipelined version of the scan loop: while the rows settle after deselecting a column, the next
+// bin's DAC value is written, the next column's pattern is shifted in (without strobing), and the
+// sample that was just taken is decoded. Only the remainder of the settle time is waited for.
+// The DAC is written before shifting, because on some controllers they share the same pins, and
+// writing the DAC clocks junk into the shift register.
+// Returns where the scan stopped: end, or with CAPSENSE_SCAN_EAGER, the slot after the first change.
+static uint8_t scan_schedule_run(uint8_t slot, uint8_t end) {
+    if (slot >= end) return slot;
+    uint16_t settle_until;
+#    if CAPSENSE_CAL_ENABLED
+    uint8_t bin = scan_bin_of_slot(slot);
+    dac_write_threshold_no_settle(cal_thresholds[scan_bins[bin].cal_bin]);
+    settle_until = scan_timer_read() + SCAN_TIMER_US_TO_TICKS(CAPSENSE_DAC_SETTLE_TIME_US);
+#    else
+    settle_until = scan_timer_read();
+#    endif
+    shift_select_col_no_strobe(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot].col));
+    scan_timer_wait_until(settle_until);
+    for (; slot < end; slot++) {
+        uint8_t interference;
+        uint8_t d = sample_strobed(&interference);
+        shift_select_nothing();
+        settle_until = scan_timer_read() + SCAN_TIMER_US_TO_TICKS(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+        if (slot + 1 < end) {
+#    if CAPSENSE_CAL_ENABLED
+            if (slot + 1 == scan_bins[bin].end) {
+                bin++;
+                dac_write_threshold_no_settle(cal_thresholds[scan_bins[bin].cal_bin]);
+                uint16_t dac_settle_until = scan_timer_read() + SCAN_TIMER_US_TO_TICKS(CAPSENSE_DAC_SETTLE_TIME_US);
+                if ((int16_t)(dac_settle_until - settle_until) > 0) {
+                    settle_until = dac_settle_until;
+                }
+            }
+#    endif
+            shift_select_col_no_strobe(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot + 1].col));
+        }
+        scan_decode(slot, d, interference);
+        scan_timer_wait_until(settle_until);
+#    if CAPSENSE_SCAN_EAGER
+        if (scan_dirty_cols) return slot + 1;
+#    endif
+    }
+    return end;
+}
+#else
+// Returns where the scan stopped: end, or with CAPSENSE_SCAN_EAGER, the slot after the first change.
+static uint8_t scan_schedule_run(uint8_t slot, uint8_t end) {
+    if (slot >= end) return slot;
+    uint8_t bin = scan_bin_of_slot(slot);
+    for (; slot < end; bin++) {
+        uint8_t bin_end = (scan_bins[bin].end < end) ? scan_bins[bin].end : end;
+#    if CAPSENSE_CAL_ENABLED
+        dac_write_threshold(cal_thresholds[scan_bins[bin].cal_bin]);
+#    endif
+        scan_pass_begin();
+#    if CAPSENSE_CAL_TIME_DOMAIN
+        // Consecutive slots of the same column only differ in sample time, and share one capture.
+        uint8_t captured_col = 0xff;
+        uint8_t interference = 0;
+        for (; slot < bin_end; slot++) {
+            if (scan_slots[slot].col != captured_col) {
+                captured_col = scan_slots[slot].col;
+                scan_capture_col(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(captured_col));
+                interference = window_value(scan_window, 0);
+            }
+            scan_decode(slot, window_value(scan_window, scan_slots[slot].time + 1), interference);
+#        if CAPSENSE_SCAN_EAGER
+            if (scan_dirty_cols) {
+                slot++;
+                break;
+            }
+#        endif
+        }
+#    else
+        for (; slot < bin_end; slot++) {
+            uint8_t interference;
+            uint8_t d = scan_sample_col(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot].col), &interference);
+            scan_decode(slot, d, interference);
+#        if CAPSENSE_SCAN_EAGER
+            if (scan_dirty_cols) {
+                slot++;
+                break;
+            }
+#        endif
+        }
+#    endif
+        scan_pass_end();
+#    if CAPSENSE_SCAN_EAGER
+        if (scan_dirty_cols) break;
+#    endif
+    }
+    return slot;
+}
+#endif
+
+#if CAPSENSE_SCAN_IN_ISR
+// Background scanning: the scan runs from the Timer1 compare interrupt. Each interrupt samples all the
+// slots of one bin back to back, like the pipelined scan loop, and then writes the next bin's DAC
+// threshold, and schedules the next interrupt for when it has settled. Only these settle gaps, and
+// CAPSENSE_SCAN_ISR_GAP_US after each pass, are left to the main loop, so a pass takes about as long
+// as in the main loop. At the end of a pass that changed something, the matrix is copied into
+// scan_isr_state, and matrix_scan_custom() only has to pick up the dirty columns, so the scan cadence
+// no longer depends on how long the main loop takes.
+// The next compare must not be set to a time that has already passed, or it would only match a
+// whole timer wrap later.
+#    define SCAN_ISR_MIN_TICKS SCAN_TIMER_US_TO_TICKS(10)
+
+static scan_state_t          scan_isr_state;
+static volatile matrix_row_t scan_isr_dirty_cols;
+static uint8_t               scan_isr_bin;
+static uint8_t               scan_isr_slot;
+static uint8_t               scan_isr_end; // end of the range of slots being scanned
+static uint16_t              scan_isr_settle_until;
+#    if CAPSENSE_CAL_ENABLED
+static bool scan_isr_dac_pending = true;
+#    endif
+#    if CAPSENSE_SCAN_HOT_KEYS
+static bool scan_isr_hot; // scanning the hot slots, the cold slice comes next
+#    endif
+
+static inline void scan_isr_seek(uint8_t first, uint8_t end) {
+    scan_isr_slot = first;
+    scan_isr_end  = end;
+    if (first < end) scan_isr_bin = scan_bin_of_slot(first);
+#    if CAPSENSE_CAL_ENABLED
+    scan_isr_dac_pending = true;
+#    endif
+}
+
+static inline void scan_isr_restart(void) {
+#    if CAPSENSE_SCAN_HOT_KEYS
+    scan_isr_hot = true;
+    scan_isr_seek(0, scan_hot_end);
+#    else
+    scan_isr_seek(0, scan_slot_count());
+#    endif
+}
+
+// Called when the current range of slots is done: moves on to the next one, or ends the pass.
+// Returns whether the pass ended.
+static bool scan_isr_range_done(void) {
+#    if CAPSENSE_SCAN_HOT_KEYS
+    if (scan_isr_hot) {
+        uint8_t first, end;
+        scan_isr_hot = false;
+        scan_next_cold_slice(&first, &end);
+        scan_isr_seek(first, end);
+        if (first < end) return false;
+    }
+#    endif
+    scan_direct_rows();
+    if (scan_dirty_cols) {
+        scan_isr_state = scan_state;
+        scan_isr_dirty_cols |= scan_dirty_cols;
+        scan_dirty_cols = 0;
+    }
+    scan_isr_restart();
+#    if CAPSENSE_SCAN_STATS
+    scan_stats_pass_done();
+#    endif
+    return true;
+}
+
+// Samples the slots of the current bin, up to the end of the range, with the DAC already settled.
+// Each sample is decoded while the rows settle, with the next column already shifted in.
+static void scan_isr_sample_bin(void) {
+    uint8_t slot = scan_isr_slot;
+    uint8_t end  = (scan_bins[scan_isr_bin].end < scan_isr_end) ? scan_bins[scan_isr_bin].end : scan_isr_end;
+    shift_select_col_no_strobe(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot].col));
+    scan_timer_wait_until(scan_isr_settle_until);
+    for (; slot < end; slot++) {
+        uint8_t interference;
+        uint8_t d = sample_strobed(&interference);
+        shift_select_nothing();
+        scan_isr_settle_until = scan_timer_read() + SCAN_TIMER_US_TO_TICKS(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+        if (slot + 1 < end) shift_select_col_no_strobe(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(scan_slots[slot + 1].col));
+        scan_decode(slot, d, interference);
+#    if CAPSENSE_SCAN_EAGER
+        if (scan_dirty_cols) {
+            scan_isr_state = scan_state;
+            scan_isr_dirty_cols |= scan_dirty_cols;
+            scan_dirty_cols = 0;
+        }
+#    endif
+        if (slot + 1 < end) scan_timer_wait_until(scan_isr_settle_until);
+    }
+    scan_isr_slot = end;
+}
+
+// Does the next step of the scan, and returns the time until the next one, in timer ticks.
+static inline uint16_t scan_isr_step(void) {
+    if (scan_bin_count == 0) return SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_ISR_GAP_US);
+#    if CAPSENSE_SOLENOID
+    // The rows take a while to recover from a solenoid edge, so the next step waits for that.
+    if (solenoid_service()) return SCAN_TIMER_US_TO_TICKS(CAPSENSE_SOLENOID_SETTLE_US);
+#    endif
+#    ifdef RAW_ENABLE
+    if (!keyboard_scan_enabled) {
+        scan_isr_restart();
+        return SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_ISR_GAP_US);
+    }
+#    endif
+    if (scan_isr_slot == scan_isr_end) {
+        // Only happens at the start of a pass, when none of the keys are hot
+        if (scan_isr_range_done()) return SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_ISR_GAP_US);
+    }
+#    if CAPSENSE_CAL_ENABLED
+    if (!scan_isr_dac_pending)
+#    endif
+    {
+        scan_isr_sample_bin();
+        if (scan_isr_slot == scan_isr_end) {
+            if (scan_isr_range_done()) return SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_ISR_GAP_US);
+        } else {
+            scan_isr_bin++;
+        }
+    }
+#    if CAPSENSE_CAL_ENABLED
+    // The rows settle at the same time as the DAC.
+    dac_write_threshold_no_settle(cal_thresholds[scan_bins[scan_isr_bin].cal_bin]);
+    scan_isr_dac_pending = false;
+    return SCAN_TIMER_US_TO_TICKS(CAPSENSE_DAC_SETTLE_TIME_US);
+#    else
+    return SCAN_TIMER_US_TO_TICKS(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+#    endif
+}
+
+ISR(TIMER1_COMPA_vect) {
+    uint16_t ticks = scan_isr_step();
+    if (ticks < SCAN_ISR_MIN_TICKS) ticks = SCAN_ISR_MIN_TICKS;
+    OCR1A = scan_timer_read() + ticks;
+}
+
+static void scan_isr_start(void) {
+    scan_isr_restart();
+    OCR1A = scan_timer_read() + SCAN_TIMER_US_TO_TICKS(CAPSENSE_SCAN_ISR_GAP_US);
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 |= (1 << OCIE1A);
+}
+
 #else
+static uint8_t scan_pass_slot;
+static uint8_t scan_pass_range_end; // end of the range of slots being scanned
+static bool    scan_pass_running;
+#    if CAPSENSE_SCAN_HOT_KEYS
+static bool scan_pass_hot; // scanning the hot slots, the cold slice comes next
+#    endif
+
+// Returns whether the pass is complete. With CAPSENSE_SCAN_EAGER, the pass stops after any slot that
+// changed the scan state, so that the change is reported right away, and the next call continues it.
+static bool scan_pass(void) {
+    if (!scan_pass_running) {
+        scan_pass_running = true;
+        scan_pass_slot    = 0;
+#    if CAPSENSE_SCAN_RESAMPLE
+        scan_resample_count = 0;
+        scan_resample_next  = 0;
+#    endif
+#    if CAPSENSE_DRIFT_COMPENSATION
+        drift_track();
+#    endif
+#    if CAPSENSE_RAPID_TRIGGER
+        rapid_keys_scan();
+#    endif
+#    if CAPSENSE_SCAN_HOT_KEYS
+        scan_pass_hot = true;
+        scan_pass_range_end = scan_hot_end;
+#        if CAPSENSE_SCAN_IDLE
+        // An idle pass covers all the keys, not only the next cold slice, so that any first press is
+        // seen within one idle period.
+        if (capsense_scan_idle) {
+            scan_pass_hot       = false;
+            scan_pass_range_end = scan_slot_count();
+        }
+#        endif
+#    else
+        scan_pass_range_end = scan_slot_count();
+#    endif
+    }
+    for (;;) {
+#    if CAPSENSE_CAL_HYSTERESIS
+        uint8_t first_slot = scan_pass_slot;
+#    endif
+        scan_pass_slot = scan_schedule_run(scan_pass_slot, scan_pass_range_end);
+#    if CAPSENSE_SCAN_RESAMPLE
+        scan_resample_run();
+#    endif
+#    if CAPSENSE_SCAN_VOTING
+        scan_vote_run();
+#    endif
+#    if CAPSENSE_CAL_HYSTERESIS
+        scan_release_run(first_slot, scan_pass_slot);
+#    endif
+        if (scan_pass_slot < scan_pass_range_end) return false;
+#    if CAPSENSE_SCAN_HOT_KEYS
+        if (scan_pass_hot) {
+            scan_pass_hot = false;
+            scan_next_cold_slice(&scan_pass_slot, &scan_pass_range_end);
+            continue;
+        }
+#    endif
+        break;
+    }
+    scan_pass_running = false;
+    scan_direct_rows();
+#    if CAPSENSE_SCAN_STATS
+    scan_stats_pass_done();
+#    endif
+    return true;
+}
+
+#    if CAPSENSE_SCAN_EAGER
+// Eager passes hand over single columns, so at the end of each pass the whole matrix is compared
+// with the scan state, as a consistency check, and resynchronized if they ever differ.
+static void matrix_check_full(const matrix_row_t current_matrix[]) {
+    matrix_row_t rows[MATRIX_ROWS];
+    memset(rows, 0, sizeof(rows));
+    scan_state_to_rows(&scan_state, rows, ~(matrix_row_t)0);
+    if (memcmp(rows, current_matrix, sizeof(rows)) != 0) {
+        matrix_resync = true;
+#        if CAPSENSE_SCAN_STATS
+        capsense_eager_mismatches++;
+#        endif
+    }
+}
+#    endif
+#endif
+
+#if CAPSENSE_SUSPEND_SCAN
+// USB suspend: instead of the calibrated schedule, QMK's remote wakeup check (matrix_power_up(),
+// matrix_scan(), matrix_power_down(), once per watchdog sleep) samples every column only once, with
+// the DAC at a single conservative threshold that all keys at rest are clear of. The shift register
+// outputs are disabled with OE between these scans. Any key that reads as pressed wakes the host, and
+// the calibrated scan simply resumes on wake up, without recalibrating.
+#    if CAPSENSE_CAL_ENABLED
+#        define SUSPEND_THRESHOLD suspend_threshold
+#    else
+#        define SUSPEND_THRESHOLD CAPSENSE_HARDCODED_THRESHOLD
+#    endif
+
+static bool scan_suspended;
+
+void suspend_power_down_kb(void) {
+    if (!scan_suspended) {
+        scan_suspended = true;
+#    if CAPSENSE_SCAN_IN_ISR
+        TIMSK1 &= ~(1 << OCIE1A);
+#    endif
+        dac_write_threshold(SUSPEND_THRESHOLD);
+        writePin(CAPSENSE_SHIFT_OE, 1);
+#    if CAPSENSE_SOLENOID
+        solenoid_suspend();
+#    endif
+    }
+    suspend_power_down_user();
+}
+
+void suspend_wakeup_init_kb(void) {
+    if (scan_suspended) {
+        scan_suspended = false;
+        writePin(CAPSENSE_SHIFT_OE, 0);
+        wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+        // Every scan loop writes its bin's threshold before sampling, so the suspend threshold
+        // doesn't linger (and without calibration, it is the only threshold).
+        matrix_resync = true;
+#    if CAPSENSE_SCAN_IN_ISR
+        scan_isr_start();
+#    endif
+#    if CAPSENSE_SOLENOID
+        solenoid_wakeup();
+#    endif
+    }
+    suspend_wakeup_init_user();
+}
+
+void matrix_power_up(void) {
+    if (scan_suspended) {
+        writePin(CAPSENSE_SHIFT_OE, 0);
+        wait_us(CAPSENSE_KEYBOARD_SETTLE_TIME_US);
+    }
+}
+
+void matrix_power_down(void) {
+    if (scan_suspended) {
+        writePin(CAPSENSE_SHIFT_OE, 1);
+    }
+}
+
+static bool scan_suspended_pass(matrix_row_t current_matrix[]) {
+    uint8_t col_rows[MATRIX_COLS];
+    uint8_t slot, col, row;
+    memset(col_rows, 0, sizeof(col_rows));
+    for (slot = 0; slot < scan_slot_count(); slot++) {
+        col_rows[scan_slots[slot].col] |= scan_slots[slot].rows;
+    }
+#    if CAPSENSE_RAPID_TRIGGER
+    for (slot = 0; slot < rapid_key_count; slot++) {
+        col_rows[rapid_keys[slot].col] |= rapid_keys[slot].row_mask;
+    }
+#    endif
+    memset(current_matrix, 0, sizeof(matrix_row_t) * MATRIX_ROWS);
     for (col = 0; col < MATRIX_COLS; col++) {
-        uint8_t real_col = CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col);
+        if (!col_rows[col]) continue;
         uint8_t interference;
-        uint8_t d = test_single(real_col, CAPSENSE_HARDCODED_SAMPLE_TIME, &interference);
+        uint8_t d = sample_col(CAPSENSE_KEYMAP_COL_TO_PHYSICAL_COL(col), SCAN_SAMPLE_TIME, &interference);
 #    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS
         d = ~d;
 #    endif
+        d &= col_rows[col] & ~interference;
         for (row = 0; row < MATRIX_CAPSENSE_ROWS; row++) {
-            current_matrix[CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(row)] |= (((matrix_row_t)(d & 1)) << col);
-            d >>= 1;
+            if (d & (1 << CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row))) {
+                current_matrix[row] |= ((matrix_row_t)1) << col;
+            }
         }
     }
+#    if MATRIX_EXTRA_DIRECT_ROWS
+    scan_direct_rows();
+    for (row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
+        current_matrix[MATRIX_CAPSENSE_ROWS + row] = scan_state.direct_rows[row];
+    }
+#    endif
+    matrix_resync = true;
+    return matrix_has_it_changed(current_matrix);
+}
+#elif CAPSENSE_SOLENOID
+void suspend_power_down_kb(void) {
+    solenoid_suspend();
+    suspend_power_down_user();
+}
+
+void suspend_wakeup_init_kb(void) {
+    solenoid_wakeup();
+    suspend_wakeup_init_user();
+}
 #endif
 
-#if MATRIX_EXTRA_DIRECT_ROWS
-    for (int row = 0; row < MATRIX_EXTRA_DIRECT_ROWS; row++) {
-        for (int col = 0; col < MATRIX_EXTRA_DIRECT_COLS; col++) {
-            pin_t pin = extra_direct_pins[row][col];
-            if (pin != NO_PIN) {
-                uint8_t value = !!readPin(pin);
-#    if MATRIX_EXTRA_DIRECT_PINS_ACTIVE_LOW
-                value = !value;
+#if CAPSENSE_EVENT_QUEUE
+// Publishes the oldest event from the scan ISR, or resynchronizes the whole matrix after an overflow.
+static bool scan_event_publish(matrix_row_t current_matrix[]) {
+    if (matrix_resync || scan_event_lost) {
+        bool changed;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            // Everything that's still in the queue is already in the scan state.
+            scan_event_tail = scan_event_head;
+            scan_event_lost = false;
+            matrix_resync   = true;
+            changed         = matrix_merge_dirty_cols(current_matrix, &scan_state, 0);
+        }
+        return changed;
+    }
+    uint8_t tail = scan_event_tail;
+    if (tail == scan_event_head) {
+        matrix_dirty_cols = 0;
+        return false;
+    }
+    uint8_t      row = scan_event_queue[tail].row;
+    matrix_row_t bit = ((matrix_row_t)1) << scan_event_queue[tail].col;
+    capsense_event_time = scan_event_queue[tail].time;
+    scan_event_tail     = (tail + 1) & (CAPSENSE_EVENT_QUEUE_SIZE - 1);
+    if (row & SCAN_EVENT_PRESSED) {
+        current_matrix[row & ~SCAN_EVENT_PRESSED] |= bit;
+    } else {
+        current_matrix[row] &= ~bit;
+    }
+#    if CAPSENSE_SCAN_STATS
+    uint16_t latency = timer_elapsed(capsense_event_time);
+    if (latency > event_latency_max_ms) event_latency_max_ms = latency;
 #    endif
-                if (value) {
-                    current_matrix[MATRIX_CAPSENSE_ROWS + row] |= ((matrix_row_t)1) << col;
-                }
-            }
+    return matrix_has_it_changed(current_matrix);
+}
+#endif
+
+void matrix_scan_raw(matrix_row_t current_matrix[]) {
+#if CAPSENSE_SCAN_IN_ISR
+    // The hardware belongs to the scan ISR, just return what it saw last.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        scan_state_to_rows(&scan_isr_state, current_matrix, ~(matrix_row_t)0);
+    }
+#else
+    // A separate read of the whole schedule, that leaves the scan state alone (together with the
+    // debounce, drift, and rapid trigger tracking that follows it). Rapid trigger keys and direct
+    // pins aren't in the schedule, and are taken from the scan state as they are.
+    scan_state_t raw = scan_state;
+    uint8_t      bin, slot;
+    for (slot = 0; slot < scan_slot_count(); slot++) {
+        raw.cols[scan_slots[slot].col] &= ~scan_slots[slot].rows;
+    }
+    slot = 0;
+    for (bin = 0; bin < scan_bin_count; bin++) {
+#    if CAPSENSE_CAL_ENABLED
+        dac_write_threshold(cal_thresholds[scan_bins[bin].cal_bin]);
+#    endif
+        scan_pass_begin();
+        for (; slot < scan_bins[bin].end; slot++) {
+            uint8_t interference;
+            uint8_t d = scan_sample_slot(slot, &interference);
+#    ifdef CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS
+            d = ~d;
+#    endif
+#    if CAPSENSE_CAL_ENABLED
+            d &= ~interference;
+#    endif
+            raw.cols[scan_slots[slot].col] |= d & scan_slots[slot].rows;
         }
+        scan_pass_end();
     }
+    scan_state_to_rows(&raw, current_matrix, ~(matrix_row_t)0);
 #endif
 }
 
@@ -840,14 +3311,51 @@ bool matrix_scan_custom(matrix_row_t current_matrix[]) {
 #ifndef NO_PRINT
     matrix_print_stats();
 #endif
+#if CAPSENSE_SOLENOID && !CAPSENSE_SCAN_IN_ISR
+    // An eager pass that's still running is continued below, so wait for its end.
+    if (!scan_pass_running && solenoid_service()) wait_us(CAPSENSE_SOLENOID_SETTLE_US);
+#endif
 #ifdef RAW_ENABLE
-    if (keyboard_scan_enabled) {
-        matrix_scan_raw(current_matrix);
-    } else {
+    if (!keyboard_scan_enabled) {
         memset(current_matrix, 0, sizeof(matrix_row_t) * MATRIX_ROWS);
+        matrix_resync = true;
+        return matrix_has_it_changed(current_matrix);
+    }
+#endif
+#if CAPSENSE_SUSPEND_SCAN
+    if (scan_suspended) {
+        return scan_suspended_pass(current_matrix);
+    }
+#endif
+    bool changed;
+#if CAPSENSE_EVENT_QUEUE
+    changed = scan_event_publish(current_matrix);
+#elif CAPSENSE_SCAN_IN_ISR
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        changed             = matrix_merge_dirty_cols(current_matrix, &scan_isr_state, scan_isr_dirty_cols);
+        scan_isr_dirty_cols = 0;
     }
 #else
-    matrix_scan_raw(current_matrix);
+#    if CAPSENSE_SCAN_IDLE
+    if (!scan_pass_running && !scan_idle_governor()) {
+        matrix_dirty_cols = 0;
+        return false;
+    }
+#    endif
+#    if CAPSENSE_SCAN_SOF_SYNC
+    sof_sync_wait();
+#    endif
+    bool complete   = scan_pass();
+    changed         = matrix_merge_dirty_cols(current_matrix, &scan_state, scan_dirty_cols);
+    scan_dirty_cols = 0;
+#    if CAPSENSE_SCAN_EAGER
+    if (complete) matrix_check_full(current_matrix);
+#    else
+    (void)complete;
+#    endif
+#    if CAPSENSE_SCAN_IDLE
+    if (changed) scan_idle_activity();
+#    endif
 #endif
-    return matrix_has_it_changed(current_matrix);
+    return changed;
 }
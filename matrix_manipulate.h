@@ -28,11 +28,62 @@ extern bool keyboard_scan_enabled;
 
 extern const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS];
 void                          matrix_scan_raw(matrix_row_t current_matrix[]);
+extern matrix_row_t           matrix_dirty_cols;
 extern uint16_t               cal_thresholds[CAPSENSE_CAL_BINS];
-extern matrix_row_t           assigned_to_threshold[CAPSENSE_CAL_BINS][MATRIX_CAPSENSE_ROWS];
+void                          get_assigned_to_threshold(uint8_t cal_bin, matrix_row_t assigned[MATRIX_CAPSENSE_ROWS]);
 uint16_t                      measure_middle_keymap_coords(uint8_t col, uint8_t row, uint8_t time, uint8_t reps);
 void                          shift_data(uint32_t data, int data_idle, int shcp_idle, int stcp_idle);
 void                          dac_write_threshold(uint16_t value);
 uint8_t                       test_single(uint8_t col, uint16_t time, uint8_t *interference_ptr);
+#if CAPSENSE_SAMPLE_CYCLE_ACCURATE
+extern uint8_t capsense_sample_cycles;
+uint8_t        test_single_cycles(uint8_t col, uint8_t cycles, uint8_t *interference_ptr);
+#endif
+#if CAPSENSE_SETTLE_DIAGNOSTIC
+extern uint8_t capsense_settle_min_us[CAPSENSE_COL_ORDERS];
+#endif
+#if CAPSENSE_EVENT_QUEUE
+extern volatile uint16_t capsense_event_overflows;
+extern uint16_t          capsense_event_time;
+#endif
+#if CAPSENSE_SCAN_IDLE
+extern bool capsense_scan_idle;
+#endif
+#if CAPSENSE_SCAN_RESAMPLE
+extern uint16_t capsense_scan_resamples;
+extern uint16_t capsense_scan_resample_drops;
+#endif
+#if CAPSENSE_DRIFT_COMPENSATION
+extern int16_t capsense_cal_drift;
+#endif
+#if CAPSENSE_SOLENOID
+extern bool     capsense_solenoid_enabled;
+extern uint32_t capsense_solenoid_samples[2];
+extern uint32_t capsense_solenoid_interfered[2];
+void            capsense_solenoid_fire(void);
+#endif
+#if CAPSENSE_SCAN_VOTING
+extern uint8_t  capsense_marginal_keys;
+extern uint16_t capsense_scan_votes;
+extern uint16_t capsense_scan_vote_rejects;
+#endif
+#if CAPSENSE_SCAN_STATS
+extern uint16_t capsense_scan_rate;
+#    if CAPSENSE_SCAN_HOT_KEYS
+extern uint16_t capsense_cold_scan_rate;
+#    endif
+#    if CAPSENSE_SCAN_EAGER && !CAPSENSE_SCAN_IN_ISR
+extern uint16_t capsense_eager_mismatches;
+#    endif
+#    if CAPSENSE_EVENT_QUEUE
+extern uint16_t capsense_event_latency_max_ms;
+#    endif
+#endif
+#if CAPSENSE_SCAN_SOF_SYNC
+extern uint16_t capsense_sof_phase_us;
+#    if CAPSENSE_SCAN_STATS
+extern uint16_t capsense_sof_phase_max_us;
+#    endif
+#endif
 
 #endif
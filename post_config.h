@@ -42,6 +42,9 @@
 #    define CAPSENSE_SHIFT_STCP_IO _SFR_IO_ADDR(PORTC)
 #    define CAPSENSE_SHIFT_STCP_BIT 7
 
+// The DAC is on the hardware SPI pins (SCK = B1, MOSI = B2, SS = B0)
+#    define CAPSENSE_DAC_PINS_ARE_SPI
+
 #    define SETUP_ROW_GPIOS() \
         do {                  \
         } while (0)
@@ -75,7 +78,8 @@
 #    define CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS [dest_row_1] "=&r"(dest_row_1), [dest_row_2] "=&r"(dest_row_2)
 #    define CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS [ioreg_row_1] "I"(CAPSENSE_READ_ROWS_PIN_1), [ioreg_row_2] "I"(CAPSENSE_READ_ROWS_PIN_2)
 #    define CAPSENSE_READ_ROWS_LOCAL_VARS uint8_t dest_row_1, dest_row_2
-#    define CAPSENSE_READ_ROWS_VALUE (dest_row_1 & 0xf)
+#    define CAPSENSE_READ_ROWS_DECODE(row_1, row_2) ((row_1) & 0xf)
+#    define CAPSENSE_READ_ROWS_VALUE CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2)
 #    define CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY \
         do {                                      \
             dest_row_1 = array[p0++];             \
@@ -108,6 +112,9 @@
 #    define CAPSENSE_SHIFT_STCP_IO _SFR_IO_ADDR(PORTD)
 #    define CAPSENSE_SHIFT_STCP_BIT 6
 
+// The DAC is on the hardware SPI pins (SCK = B1, MOSI = B2, SS = B0)
+#    define CAPSENSE_DAC_PINS_ARE_SPI
+
 #    define SETUP_ROW_GPIOS() \
         do {                  \
             PORTC |= 0xF0;    \
@@ -159,14 +166,19 @@
 #        endif
 #        define CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row) (row)
 #        define CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(row) (row)
-#        define CAPSENSE_READ_ROWS_VALUE ((((dest_row_1 >> 4) & 1) << (7 - 1)) | (((dest_row_1 >> 5) & 1) << (5 - 1)) | (((dest_row_1 >> 6) & 1) << (3 - 1)) | (((dest_row_1 >> 7) & 1) << (1 - 1)) | (((dest_row_2 >> 0) & 1) << (2 - 1)) | (((dest_row_2 >> 1) & 1) << (4 - 1)) | (((dest_row_2 >> 2) & 1) << (6 - 1)) | (((dest_row_2 >> 3) & 1) << (8 - 1)))
+// The sense lines are interleaved over the high nibble of PINC and the low nibble of PIND, so each bit
+// has to be moved separately. Decode with a table per nibble instead:
+#        define CAPSENSE_READ_ROWS_DECODE_NIBBLE_TABLES
+#        define CAPSENSE_READ_ROWS_DECODE(row_1, row_2) (((((row_1) >> 4) & 1) << (7 - 1)) | ((((row_1) >> 5) & 1) << (5 - 1)) | ((((row_1) >> 6) & 1) << (3 - 1)) | ((((row_1) >> 7) & 1) << (1 - 1)) | ((((row_2) >> 0) & 1) << (2 - 1)) | ((((row_2) >> 1) & 1) << (4 - 1)) | ((((row_2) >> 2) & 1) << (6 - 1)) | ((((row_2) >> 3) & 1) << (8 - 1)))
+#        define CAPSENSE_READ_ROWS_VALUE CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2)
 #    else
 #        if (!defined(CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS)) && (!defined(CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS))
 #            define CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS
 #        endif
 #        define CAPSENSE_KEYMAP_ROW_TO_PHYSICAL_ROW(row) (7 - (row))
 #        define CAPSENSE_PHYSICAL_ROW_TO_KEYMAP_ROW(row) (7 - (row))
-#        define CAPSENSE_READ_ROWS_VALUE ((dest_row_1 >> 4) | (dest_row_2 << 4))
+#        define CAPSENSE_READ_ROWS_DECODE(row_1, row_2) (((row_1) >> 4) | ((row_2) << 4))
+#        define CAPSENSE_READ_ROWS_VALUE CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2)
 #    endif
 
 #elif defined(CONTROLLER_IS_THROUGH_HOLE_BEAMSPRING) || defined(CONTROLLER_IS_THROUGH_HOLE_MODEL_F)
@@ -184,6 +196,10 @@
 #    define CAPSENSE_SHIFT_STCP_IO _SFR_IO_ADDR(PORTF)
 #    define CAPSENSE_SHIFT_STCP_BIT 7
 
+// Both the DAC and the shift register are on the hardware SPI pins (SCK = B1, MOSI = B2)
+#    define CAPSENSE_DAC_PINS_ARE_SPI
+#    define CAPSENSE_SHIFT_PINS_ARE_SPI
+
 // Rows:
 // Physical position from left to right: (only the right-most are used for beamspring)
 // 1    2    3    4    5    6    7    8
@@ -240,7 +256,8 @@
 #        define CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS [dest_row_1] "=&r"(dest_row_1), [dest_row_2] "=&r"(dest_row_2)
 #        define CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS [ioreg_row_1] "I"(CAPSENSE_READ_ROWS_PIN_1), [ioreg_row_2] "I"(CAPSENSE_READ_ROWS_PIN_2)
 #        define CAPSENSE_READ_ROWS_LOCAL_VARS uint8_t dest_row_1, dest_row_2
-#        define CAPSENSE_READ_ROWS_VALUE (((dest_row_1 >> 4) & 0x04) | (dest_row_2 & 0x03) | ((dest_row_2 >> 1) & 0x08))
+#        define CAPSENSE_READ_ROWS_DECODE(row_1, row_2) ((((row_1) >> 4) & 0x04) | ((row_2) & 0x03) | (((row_2) >> 1) & 0x08))
+#        define CAPSENSE_READ_ROWS_VALUE CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2)
 #        define CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY \
             do {                                      \
                 dest_row_1 = array[p0++];             \
@@ -275,7 +292,8 @@
 #        define CAPSENSE_READ_ROWS_OUTPUT_CONSTRAINTS [dest_row_1] "=&r"(dest_row_1), [dest_row_2] "=&r"(dest_row_2), [dest_row_3] "=&r"(dest_row_3), [dest_row_4] "=&r"(dest_row_4)
 #        define CAPSENSE_READ_ROWS_INPUT_CONSTRAINTS [ioreg_row_1] "I"(CAPSENSE_READ_ROWS_PIN_1), [ioreg_row_2] "I"(CAPSENSE_READ_ROWS_PIN_2), [ioreg_row_3] "I"(CAPSENSE_READ_ROWS_PIN_3), [ioreg_row_4] "I"(CAPSENSE_READ_ROWS_PIN_4)
 #        define CAPSENSE_READ_ROWS_LOCAL_VARS uint8_t dest_row_1, dest_row_2, dest_row_3, dest_row_4
-#        define CAPSENSE_READ_ROWS_VALUE (((dest_row_1 >> 4) & 0x04) | (dest_row_2 & 0x03) | ((dest_row_2 >> 1) & 0x08) | (dest_row_3 & 0x10) | ((dest_row_3 << 1) & 0x40) | ((dest_row_4 << 1) & 0x20) | ((dest_row_4 << 2) & 0x80))
+#        define CAPSENSE_READ_ROWS_DECODE(row_1, row_2, row_3, row_4) ((((row_1) >> 4) & 0x04) | ((row_2) & 0x03) | (((row_2) >> 1) & 0x08) | ((row_3) & 0x10) | (((row_3) << 1) & 0x40) | (((row_4) << 1) & 0x20) | (((row_4) << 2) & 0x80))
+#        define CAPSENSE_READ_ROWS_VALUE CAPSENSE_READ_ROWS_DECODE(dest_row_1, dest_row_2, dest_row_3, dest_row_4)
 #        define CAPSENSE_READ_ROWS_EXTRACT_FROM_ARRAY \
             do {                                      \
                 dest_row_1 = array[p0++];             \
@@ -335,6 +353,347 @@
 #    error "Please define CAPSENSE_CAL_THRESHOLD_OFFSET in config.h"
 #endif
 
+#ifndef CAPSENSE_HW_SPI_ENABLE
+#    define CAPSENSE_HW_SPI_ENABLE 0
+#endif
+// Custom pinouts can define CAPSENSE_DAC_PINS_ARE_SPI / CAPSENSE_SHIFT_PINS_ARE_SPI when the clock and
+// data lines are on SCK (B1) and MOSI (B2), or CAPSENSE_DAC_PINS_ARE_USART_SPI /
+// CAPSENSE_SHIFT_PINS_ARE_USART_SPI when they are on XCK1 (D5) and TXD1 (D3).
+// Otherwise the bit-banged implementation is used.
+#if CAPSENSE_HW_SPI_ENABLE && defined(CAPSENSE_DAC_PINS_ARE_SPI)
+#    define CAPSENSE_DAC_USE_SPI 1
+#elif CAPSENSE_HW_SPI_ENABLE && defined(CAPSENSE_DAC_PINS_ARE_USART_SPI)
+#    define CAPSENSE_DAC_USE_USART_SPI 1
+#endif
+#if CAPSENSE_HW_SPI_ENABLE && defined(CAPSENSE_SHIFT_PINS_ARE_SPI)
+#    define CAPSENSE_SHIFT_USE_SPI 1
+#elif CAPSENSE_HW_SPI_ENABLE && defined(CAPSENSE_SHIFT_PINS_ARE_USART_SPI)
+#    define CAPSENSE_SHIFT_USE_USART_SPI 1
+#endif
+
+#ifndef CAPSENSE_SHIFT_WALKING_ONE
+#    define CAPSENSE_SHIFT_WALKING_ONE 0
+#endif
+#ifndef CAPSENSE_SCAN_PIPELINED
+#    define CAPSENSE_SCAN_PIPELINED 0
+#endif
+#if CAPSENSE_SCAN_PIPELINED && CAPSENSE_SHIFT_WALKING_ONE
+#    error "CAPSENSE_SCAN_PIPELINED and CAPSENSE_SHIFT_WALKING_ONE can't be enabled at the same time"
+#endif
+#ifndef CAPSENSE_SCAN_IN_ISR
+#    define CAPSENSE_SCAN_IN_ISR 0
+#endif
+#ifndef CAPSENSE_SCAN_ISR_GAP_US
+#    define CAPSENSE_SCAN_ISR_GAP_US 100
+#endif
+#if CAPSENSE_SCAN_IN_ISR && (CAPSENSE_SCAN_PIPELINED || CAPSENSE_SHIFT_WALKING_ONE)
+#    error "CAPSENSE_SCAN_IN_ISR can't be combined with CAPSENSE_SCAN_PIPELINED or CAPSENSE_SHIFT_WALKING_ONE"
+#endif
+#ifndef CAPSENSE_SCAN_SOF_SYNC
+#    define CAPSENSE_SCAN_SOF_SYNC 0
+#endif
+#ifndef CAPSENSE_SCAN_SOF_MARGIN_US
+#    define CAPSENSE_SCAN_SOF_MARGIN_US 100
+#endif
+#if CAPSENSE_SCAN_SOF_SYNC && CAPSENSE_SCAN_IN_ISR
+#    error "CAPSENSE_SCAN_SOF_SYNC can't be combined with CAPSENSE_SCAN_IN_ISR"
+#endif
+// These take over Timer1, which QMK's sleep LED and backlight on AVR use too
+#if (CAPSENSE_SCAN_PIPELINED || CAPSENSE_SCAN_IN_ISR || CAPSENSE_SCAN_SOF_SYNC || CAPSENSE_SETTLE_DIAGNOSTIC) && (defined(SLEEP_LED_ENABLE) || defined(BACKLIGHT_ENABLE))
+#    error "CAPSENSE_SCAN_PIPELINED, CAPSENSE_SCAN_IN_ISR, CAPSENSE_SCAN_SOF_SYNC and CAPSENSE_SETTLE_DIAGNOSTIC use Timer1, and can't be combined with SLEEP_LED_ENABLE or BACKLIGHT_ENABLE"
+#endif
+#ifndef CAPSENSE_SAMPLE_CYCLE_ACCURATE
+#    define CAPSENSE_SAMPLE_CYCLE_ACCURATE 0
+#endif
+#ifndef CAPSENSE_SAMPLE_CYCLES_MAX
+#    define CAPSENSE_SAMPLE_CYCLES_MAX 120
+#endif
+#ifndef CAPSENSE_HARDCODED_SAMPLE_CYCLES
+// Same sample point as CAPSENSE_HARDCODED_SAMPLE_TIME iterations of the test_single() loop
+#    define CAPSENSE_HARDCODED_SAMPLE_CYCLES (CAPSENSE_HARDCODED_SAMPLE_TIME * (3 * CAPSENSE_READ_ROWS_NUMBER_OF_BYTES_PER_SAMPLE + 6))
+#endif
+#if CAPSENSE_SAMPLE_CYCLE_ACCURATE && ((CAPSENSE_SAMPLE_CYCLES_MAX > 253) || (CAPSENSE_HARDCODED_SAMPLE_CYCLES > CAPSENSE_SAMPLE_CYCLES_MAX + 2))
+#    error "CAPSENSE_HARDCODED_SAMPLE_CYCLES must be at most CAPSENSE_SAMPLE_CYCLES_MAX + 2, which must be at most 253"
+#endif
+#ifndef CAPSENSE_CAL_TIME_DOMAIN
+#    define CAPSENSE_CAL_TIME_DOMAIN 0
+#endif
+#ifndef CAPSENSE_CAL_TIME_DOMAIN_LEVELS
+#    define CAPSENSE_CAL_TIME_DOMAIN_LEVELS 2
+#endif
+#ifndef CAPSENSE_CAL_TIME_DOMAIN_SAMPLES
+#    define CAPSENSE_CAL_TIME_DOMAIN_SAMPLES 8
+#endif
+#if CAPSENSE_CAL_TIME_DOMAIN
+#    if !CAPSENSE_CAL_ENABLED
+#        error "CAPSENSE_CAL_TIME_DOMAIN requires CAPSENSE_CAL_ENABLED"
+#    endif
+#    if CAPSENSE_SCAN_PIPELINED || CAPSENSE_SCAN_IN_ISR || CAPSENSE_SAMPLE_CYCLE_ACCURATE
+#        error "CAPSENSE_CAL_TIME_DOMAIN can't be combined with CAPSENSE_SCAN_PIPELINED, CAPSENSE_SCAN_IN_ISR or CAPSENSE_SAMPLE_CYCLE_ACCURATE"
+#    endif
+#    if (CAPSENSE_CAL_TIME_DOMAIN_LEVELS > CAPSENSE_CAL_BINS) || (CAPSENSE_CAL_TIME_DOMAIN_SAMPLES > 8) || (MATRIX_COLS > 32)
+#        error "CAPSENSE_CAL_TIME_DOMAIN supports at most CAPSENSE_CAL_BINS levels, 8 samples, and 32 columns"
+#    endif
+#endif
+#ifndef CAPSENSE_SCAN_HOT_KEYS
+#    define CAPSENSE_SCAN_HOT_KEYS 0
+#endif
+#ifndef CAPSENSE_SCAN_HOT_KEYCODES
+#    define CAPSENSE_SCAN_HOT_KEYCODES KC_W, KC_A, KC_S, KC_D
+#endif
+#ifndef CAPSENSE_SCAN_COLD_SLICES
+#    define CAPSENSE_SCAN_COLD_SLICES 4
+#endif
+#if CAPSENSE_SCAN_HOT_KEYS && ((CAPSENSE_SCAN_COLD_SLICES < 1) || (CAPSENSE_SCAN_COLD_SLICES > 16))
+#    error "CAPSENSE_SCAN_COLD_SLICES must be between 1 and 16"
+#endif
+#ifndef CAPSENSE_SCAN_EAGER
+#    define CAPSENSE_SCAN_EAGER 0
+#endif
+#if CAPSENSE_SCAN_EAGER && CAPSENSE_SCAN_SOF_SYNC
+#    error "CAPSENSE_SCAN_EAGER can't be combined with CAPSENSE_SCAN_SOF_SYNC"
+#endif
+#ifndef CAPSENSE_SCAN_IDLE
+#    define CAPSENSE_SCAN_IDLE 0
+#endif
+#ifndef CAPSENSE_SCAN_IDLE_TIMEOUT_MS
+#    define CAPSENSE_SCAN_IDLE_TIMEOUT_MS 30000
+#endif
+#ifndef CAPSENSE_SCAN_IDLE_PERIOD_MS
+#    define CAPSENSE_SCAN_IDLE_PERIOD_MS 10
+#endif
+#if CAPSENSE_SCAN_IDLE && CAPSENSE_SCAN_IN_ISR
+#    error "CAPSENSE_SCAN_IDLE can't be combined with CAPSENSE_SCAN_IN_ISR"
+#endif
+#ifndef CAPSENSE_SUSPEND_SCAN
+#    define CAPSENSE_SUSPEND_SCAN 0
+#endif
+#define CAPSENSE_COL_ORDER_KEYMAP 0
+#define CAPSENSE_COL_ORDER_INTERLEAVED 1
+#define CAPSENSE_COL_ORDER_FARTHEST_FIRST 2
+#define CAPSENSE_COL_ORDERS 3
+#ifndef CAPSENSE_SCAN_COL_ORDER
+#    define CAPSENSE_SCAN_COL_ORDER CAPSENSE_COL_ORDER_KEYMAP
+#endif
+#ifndef CAPSENSE_SETTLE_DIAGNOSTIC
+#    define CAPSENSE_SETTLE_DIAGNOSTIC 0
+#endif
+#ifndef CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US
+#    define CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US 50
+#endif
+#ifndef CAPSENSE_SETTLE_DIAGNOSTIC_REPS
+#    define CAPSENSE_SETTLE_DIAGNOSTIC_REPS 8
+#endif
+#if CAPSENSE_SETTLE_DIAGNOSTIC && (CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US > 254)
+#    error "CAPSENSE_SETTLE_DIAGNOSTIC_MAX_US must be at most 254"
+#endif
+// The diagnostic adds a lot of captures to every boot, so it's only for debug builds
+#if CAPSENSE_SETTLE_DIAGNOSTIC && !CAPSENSE_CAL_DEBUG
+#    error "CAPSENSE_SETTLE_DIAGNOSTIC requires CAPSENSE_CAL_DEBUG"
+#endif
+#ifndef CAPSENSE_EVENT_QUEUE
+#    define CAPSENSE_EVENT_QUEUE 0
+#endif
+#ifndef CAPSENSE_EVENT_QUEUE_SIZE
+#    define CAPSENSE_EVENT_QUEUE_SIZE 16
+#endif
+#if CAPSENSE_EVENT_QUEUE
+#    if !CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_EVENT_QUEUE requires CAPSENSE_SCAN_IN_ISR"
+#    endif
+#    if (CAPSENSE_EVENT_QUEUE_SIZE & (CAPSENSE_EVENT_QUEUE_SIZE - 1)) || (CAPSENSE_EVENT_QUEUE_SIZE > 128)
+#        error "CAPSENSE_EVENT_QUEUE_SIZE must be a power of two, at most 128"
+#    endif
+// QMK's debounce would collect the events of a burst again, and hand them over in matrix order.
+#    undef DEBOUNCE
+#    define DEBOUNCE 0
+#endif
+#ifndef CAPSENSE_CAL_HYSTERESIS
+#    define CAPSENSE_CAL_HYSTERESIS 0
+#endif
+#ifndef CAPSENSE_CAL_HYSTERESIS_BAND
+#    define CAPSENSE_CAL_HYSTERESIS_BAND CAPSENSE_CAL_THRESHOLD_OFFSET
+#endif
+#ifndef CAPSENSE_CAL_HYSTERESIS_DEBOUNCE
+#    define CAPSENSE_CAL_HYSTERESIS_DEBOUNCE 0
+#endif
+#if CAPSENSE_CAL_HYSTERESIS
+#    if !CAPSENSE_CAL_ENABLED
+#        error "CAPSENSE_CAL_HYSTERESIS requires CAPSENSE_CAL_ENABLED"
+#    endif
+#    if CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_CAL_HYSTERESIS is not supported with CAPSENSE_SCAN_IN_ISR"
+#    endif
+#    if CAPSENSE_CAL_HYSTERESIS_BAND >= 2 * CAPSENSE_CAL_THRESHOLD_OFFSET
+#        error "CAPSENSE_CAL_HYSTERESIS_BAND must be less than twice CAPSENSE_CAL_THRESHOLD_OFFSET"
+#    endif
+// The hysteresis replaces the time-based debounce
+#    undef DEBOUNCE
+#    define DEBOUNCE CAPSENSE_CAL_HYSTERESIS_DEBOUNCE
+#endif
+#ifndef CAPSENSE_KEY_DEBOUNCE
+#    define CAPSENSE_KEY_DEBOUNCE 0
+#endif
+#ifndef CAPSENSE_KEY_DEBOUNCE_RELEASE_MS
+#    define CAPSENSE_KEY_DEBOUNCE_RELEASE_MS 5
+#endif
+#if CAPSENSE_KEY_DEBOUNCE
+#    if CAPSENSE_KEY_DEBOUNCE_RELEASE_MS > 254
+#        error "CAPSENSE_KEY_DEBOUNCE_RELEASE_MS must be at most 254"
+#    endif
+// The per-key debounce replaces QMK's debounce
+#    undef DEBOUNCE
+#    define DEBOUNCE 0
+#endif
+// Direct-wired keys are debounced in the matrix scan, so they stay debounced when the options above
+// set DEBOUNCE to 0; with CAPSENSE_KEY_DEBOUNCE, they use the same release window as the capsense keys
+#ifdef MATRIX_EXTRA_DIRECT_ROWS
+#    ifndef MATRIX_EXTRA_DIRECT_DEBOUNCE_MS
+#        if CAPSENSE_KEY_DEBOUNCE
+#            define MATRIX_EXTRA_DIRECT_DEBOUNCE_MS CAPSENSE_KEY_DEBOUNCE_RELEASE_MS
+#        else
+#            define MATRIX_EXTRA_DIRECT_DEBOUNCE_MS 5
+#        endif
+#    endif
+#    if MATRIX_EXTRA_DIRECT_DEBOUNCE_MS > 254
+#        error "MATRIX_EXTRA_DIRECT_DEBOUNCE_MS must be at most 254"
+#    endif
+#endif
+#ifndef CAPSENSE_SCAN_RESAMPLE
+#    define CAPSENSE_SCAN_RESAMPLE 0
+#endif
+#ifndef CAPSENSE_SCAN_RESAMPLE_BUDGET
+#    define CAPSENSE_SCAN_RESAMPLE_BUDGET 8
+#endif
+#ifndef CAPSENSE_INTERFERENCE_SAMPLES
+#    if CAPSENSE_SCAN_RESAMPLE
+#        define CAPSENSE_INTERFERENCE_SAMPLES 3
+#    else
+#        define CAPSENSE_INTERFERENCE_SAMPLES 1
+#    endif
+#endif
+#if CAPSENSE_SCAN_RESAMPLE
+#    if !CAPSENSE_CAL_ENABLED
+#        error "CAPSENSE_SCAN_RESAMPLE requires CAPSENSE_CAL_ENABLED"
+#    endif
+#    if CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_SCAN_RESAMPLE is not supported with CAPSENSE_SCAN_IN_ISR"
+#    endif
+#    if (CAPSENSE_SCAN_RESAMPLE_BUDGET < 1) || (CAPSENSE_SCAN_RESAMPLE_BUDGET > 255)
+#        error "CAPSENSE_SCAN_RESAMPLE_BUDGET must be between 1 and 255"
+#    endif
+#endif
+#if CAPSENSE_INTERFERENCE_SAMPLES < 1
+#    error "CAPSENSE_INTERFERENCE_SAMPLES must be at least 1"
+#endif
+#ifndef CAPSENSE_SCAN_VOTING
+#    define CAPSENSE_SCAN_VOTING 0
+#endif
+#ifndef CAPSENSE_SCAN_VOTING_MARGIN
+#    define CAPSENSE_SCAN_VOTING_MARGIN (CAPSENSE_CAL_THRESHOLD_OFFSET / 2)
+#endif
+#ifndef CAPSENSE_SCAN_VOTING_SAMPLES
+#    define CAPSENSE_SCAN_VOTING_SAMPLES 5
+#endif
+#if CAPSENSE_SCAN_VOTING
+#    if !CAPSENSE_CAL_ENABLED || CAPSENSE_CAL_TIME_DOMAIN
+#        error "CAPSENSE_SCAN_VOTING requires CAPSENSE_CAL_ENABLED, without CAPSENSE_CAL_TIME_DOMAIN"
+#    endif
+#    if CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_SCAN_VOTING is not supported with CAPSENSE_SCAN_IN_ISR"
+#    endif
+#    if (CAPSENSE_SCAN_VOTING_SAMPLES < 3) || (CAPSENSE_SCAN_VOTING_SAMPLES > 15) || !(CAPSENSE_SCAN_VOTING_SAMPLES & 1)
+#        error "CAPSENSE_SCAN_VOTING_SAMPLES must be odd, between 3 and 15"
+#    endif
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER
+#    define CAPSENSE_RAPID_TRIGGER 0
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER_KEYCODES
+#    define CAPSENSE_RAPID_TRIGGER_KEYCODES KC_W, KC_A, KC_S, KC_D
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER_MAX_KEYS
+#    define CAPSENSE_RAPID_TRIGGER_MAX_KEYS 8
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER_DELTA
+#    define CAPSENSE_RAPID_TRIGGER_DELTA (CAPSENSE_CAL_THRESHOLD_OFFSET / 2)
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER_STEPS
+#    define CAPSENSE_RAPID_TRIGGER_STEPS 3
+#endif
+#ifndef CAPSENSE_RAPID_TRIGGER_FOLLOW_MS
+#    define CAPSENSE_RAPID_TRIGGER_FOLLOW_MS 250
+#endif
+#if CAPSENSE_RAPID_TRIGGER
+#    if !CAPSENSE_CAL_ENABLED
+#        error "CAPSENSE_RAPID_TRIGGER requires CAPSENSE_CAL_ENABLED"
+#    endif
+#    if CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_RAPID_TRIGGER is not supported with CAPSENSE_SCAN_IN_ISR"
+#    endif
+#    if (CAPSENSE_RAPID_TRIGGER_DELTA < 2) || (CAPSENSE_RAPID_TRIGGER_STEPS < 1)
+#        error "CAPSENSE_RAPID_TRIGGER_DELTA must be at least 2, and CAPSENSE_RAPID_TRIGGER_STEPS at least 1"
+#    endif
+#endif
+#ifndef CAPSENSE_DRIFT_COMPENSATION
+#    define CAPSENSE_DRIFT_COMPENSATION 0
+#endif
+#ifndef CAPSENSE_DRIFT_STEPS
+#    define CAPSENSE_DRIFT_STEPS 1
+#endif
+#ifndef CAPSENSE_DRIFT_FILTER_SHIFT
+#    define CAPSENSE_DRIFT_FILTER_SHIFT 8
+#endif
+#ifndef CAPSENSE_DRIFT_FILTER_PERIOD_MS
+#    define CAPSENSE_DRIFT_FILTER_PERIOD_MS 40
+#endif
+#if CAPSENSE_DRIFT_COMPENSATION
+#    if !CAPSENSE_CAL_ENABLED
+#        error "CAPSENSE_DRIFT_COMPENSATION requires CAPSENSE_CAL_ENABLED"
+#    endif
+#    if CAPSENSE_SCAN_IN_ISR
+#        error "CAPSENSE_DRIFT_COMPENSATION is not supported with CAPSENSE_SCAN_IN_ISR"
+#    endif
+// The reference keys depend on the board, there's no default that's unused everywhere
+#    ifndef CAPSENSE_DRIFT_REF_KEYS
+#        error "CAPSENSE_DRIFT_COMPENSATION requires CAPSENSE_DRIFT_REF_KEYS"
+#    endif
+#    if (CAPSENSE_DRIFT_STEPS < 1) || (CAPSENSE_DRIFT_FILTER_SHIFT > 16) || (CAPSENSE_DRIFT_FILTER_PERIOD_MS < 1)
+#        error "CAPSENSE_DRIFT_STEPS and CAPSENSE_DRIFT_FILTER_PERIOD_MS must be at least 1, and CAPSENSE_DRIFT_FILTER_SHIFT at most 16"
+#    endif
+#endif
+#ifndef CAPSENSE_SOLENOID
+#    define CAPSENSE_SOLENOID 0
+#endif
+#if CAPSENSE_SOLENOID
+#    ifdef HAPTIC_ENABLE
+#        error "CAPSENSE_SOLENOID replaces QMK's solenoid driver, remove HAPTIC_ENABLE from rules.mk"
+#    endif
+#    ifndef CAPSENSE_SOLENOID_PIN
+#        ifdef SOLENOID_PIN
+#            define CAPSENSE_SOLENOID_PIN SOLENOID_PIN
+#        else
+#            define CAPSENSE_SOLENOID_PIN B6
+#        endif
+#    endif
+#    ifndef CAPSENSE_SOLENOID_DWELL_MS
+#        ifdef SOLENOID_DEFAULT_DWELL
+#            define CAPSENSE_SOLENOID_DWELL_MS SOLENOID_DEFAULT_DWELL
+#        else
+#            define CAPSENSE_SOLENOID_DWELL_MS 20
+#        endif
+#    endif
+#    ifndef CAPSENSE_SOLENOID_SETTLE_US
+#        define CAPSENSE_SOLENOID_SETTLE_US 100
+#    endif
+#    ifndef HAPTIC_OFF_IN_LOW_POWER
+#        define HAPTIC_OFF_IN_LOW_POWER 0
+#    endif
+#endif
+#ifndef CAPSENSE_SCAN_STATS
+#    define CAPSENSE_SCAN_STATS 0
+#endif
+
 #if (!defined(CAPSENSE_CONDUCTIVE_PLASTIC_IS_PULLED_UP_ON_KEYPRESS)) && (!defined(CAPSENSE_CONDUCTIVE_PLASTIC_IS_PUSHED_DOWN_ON_KEYPRESS))
 #    error "Please specify whether the flyplate is pushed down or pulled up on keypress!"
 #endif
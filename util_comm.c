@@ -92,16 +92,18 @@ void raw_hid_receive_kb(uint8_t *data, uint8_t length) {
 #    if CAPSENSE_CAL_ENABLED
             response[3] = CAPSENSE_CAL_BINS;
             {
-                const uint8_t cal_bin           = data[3];
+                const uint8_t cal_bin = data[3];
+                matrix_row_t  assigned_to_threshold[MATRIX_CAPSENSE_ROWS];
+                get_assigned_to_threshold(cal_bin, assigned_to_threshold);
                 response[4]                     = cal_thresholds[cal_bin] & 0xff;
                 response[5]                     = (cal_thresholds[cal_bin] >> 8) & 0xff;
-                char *assigned_to_threshold_ptr = (char *)assigned_to_threshold[cal_bin];
+                char *assigned_to_threshold_ptr = (char *)assigned_to_threshold;
                 int   offset                    = 0;
-                if (sizeof(assigned_to_threshold[cal_bin]) > 32 - 6) {
+                if (sizeof(assigned_to_threshold) > 32 - 6) {
                     offset = data[4];
                     assigned_to_threshold_ptr += offset;
                 }
-                memcpy(&response[6], assigned_to_threshold_ptr, min(32 - 6, sizeof(assigned_to_threshold[cal_bin]) - offset));
+                memcpy(&response[6], assigned_to_threshold_ptr, min(32 - 6, sizeof(assigned_to_threshold) - offset));
             }
 #    else
             response[3] = 0;